@@ -36,11 +36,19 @@
 #define POOL_SIZE 100
 #define DEFAULT_MIME_TYPE   "application/octet-stream"
 #define MULTIPART_MIN       20971520  /* Minimum size for multipart files */
-#define MULTIPART_CHUNK     10485760  /* 10MB */
-#define MULTIPART_COPY_SIZE 524288000 /* 500MB */
-#define MAX_FILE_SIZE       104857600000 /* 97.65GB (10,000 * 10MB) */
+#define MULTIPART_COPY_MIN  104857600 /* 100MB */
+#define MAX_PARTS           10000
+#define PARTS_PER_CONNECTION 4
+#define MAX_FILE_SIZE       5497558138880LL /* 5TB */
+#define JOURNAL_MAGIC       "stormfs-upload 1"
+#define LIST_SPLIT_LAST     '~' /* last character shards split names on */
+#define LIST_HELD_MAX       1000 /* entries a shard holds before pausing */
 
 static pthread_mutex_t lock        = PTHREAD_MUTEX_INITIALIZER;
+
+/* set by a thread whose uploads may be called off midway, checked
+   between transfers */
+static __thread const volatile bool *cancel = NULL;
 static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
 
 struct stormfs_curl {
@@ -52,19 +60,16 @@ struct stormfs_curl {
   GList *pool;
   GList *marker;
   bool pool_full;
+  size_t part_size;
+  size_t connections;
+  size_t upload_connections;
+  size_t upload_part_size;
+  size_t list_shards;
+  char *journal_dir;
   CURLM *multi;
   CURLSH *share;
 } curl;
 
-typedef struct {
-  int fd;
-  int part_num;
-  char *path;
-  char *etag;
-  char *upload_id;
-  size_t size;
-} FILE_PART;
-
 typedef struct {
   CURL *c;
   bool in_use;
@@ -75,6 +80,31 @@ typedef struct {
   size_t size;
 } HTTP_RESPONSE;
 
+typedef struct {
+  int fd;
+  int part_num;
+  char *path;
+  char *etag;
+  char *upload_id;
+  off_t offset;
+  size_t size;
+  size_t sent;
+  const char *object;
+  const char *source;      /* object a copied part comes from */
+  const char *source_etag; /* version of the source it must match */
+  FILE *journal;           /* journal recording the part once it's sent */
+  HTTP_RESPONSE response;
+  struct curl_slist *headers;
+} FILE_PART;
+
+struct multipart {
+  char *path;
+  char *upload_id;
+  GList *headers;       /* headers the upload was started with */
+  GList *parts;         /* parts put so far, by part number */
+  pthread_mutex_t lock;
+};
+
 typedef struct {
   CURL *c;
   char *url;
@@ -89,6 +119,65 @@ struct post_data {
   int remaining;
 };
 
+struct range_data {
+  int fd;
+  off_t offset;
+  off_t size;
+  off_t written;
+  off_t total;   /* object size from Content-Range, -1 if unknown */
+  bool whole;    /* the range was ignored, the entire object is coming */
+};
+
+/* a ListBucket page being parsed as it arrives, only the element in
+   progress is buffered */
+struct list_parser {
+  char *buf;
+  size_t len;
+  size_t size;
+  int entries;          /* <Contents> seen on this attempt at the page */
+  int skip;             /* entries already handed out by a failed attempt */
+  bool truncated;
+  bool stopped;
+  bool held;            /* page ahead of the one being parsed, only buffered */
+  char *marker;         /* NextMarker of the page */
+  list_entry_fn fn;
+  void *data;
+};
+
+/* a page of a listing, requested as soon as the page before it names
+   its marker */
+struct list_page {
+  CURL *c;
+  char *marker;
+  struct curl_slist *headers;
+  struct list_parser lp;
+  uint8_t attempts;
+  bool done;
+};
+
+/* a slice of the keys under a prefix: those after the marker its first
+   page starts from, up to and including end */
+struct list_shard {
+  char *end;            /* NULL for the last shard */
+  struct list_page *cur;
+  struct list_page *ahead;
+  GQueue held;          /* entries waiting on the shards before this one */
+  char *next;           /* marker to go on from once held is handed over */
+  bool direct;          /* the shards before this one are done */
+  bool stopped;         /* the caller wants no more entries */
+  list_entry_fn fn;
+  void *data;
+};
+
+typedef struct {
+  const char *path;
+  char *range;
+  off_t offset;
+  off_t size;
+  struct range_data rd;
+  struct curl_slist *headers;
+} RANGE_PART;
+
 uid_t
 get_uid(const char *s)
 {
@@ -242,6 +331,21 @@ headers_to_stat(GList *headers, struct stat *stbuf)
   return 0;
 }
 
+char *
+headers_to_etag(GList *headers)
+{
+  GList *head = NULL;
+
+  for(head = g_list_first(headers); head != NULL; head = head->next) {
+    HTTP_HEADER *header = head->data;
+
+    if(strcmp(header->key, "ETag") == 0)
+      return strdup(header->value);
+  }
+
+  return NULL;
+}
+
 char
 char_to_hex(char c)
 {
@@ -261,15 +365,9 @@ create_part(int part_num, char *upload_id)
 {
   FILE_PART *fp = g_new0(FILE_PART, 1);
 
+  fp->fd = -1;
   fp->part_num = part_num;
   fp->upload_id = strdup(upload_id);
-  fp->path = strdup("/tmp/stormfs.XXXXXX");
-  if((fp->fd = mkstemp(fp->path)) == -1) {
-    perror("mkstemp");
-    free(fp->path);
-    free(fp);
-    return NULL;
-  }
 
   return fp;
 }
@@ -280,6 +378,8 @@ free_part(FILE_PART *fp)
   free(fp->path);
   free(fp->etag);
   free(fp->upload_id);
+  g_free(fp->response.memory);
+  curl_slist_free_all(fp->headers);
   free(fp);
 }
 
@@ -402,6 +502,17 @@ copy_source_range_header(off_t first, off_t last)
   return h;
 }
 
+HTTP_HEADER *
+copy_source_if_match_header(const char *etag)
+{
+  HTTP_HEADER *h = g_new0(HTTP_HEADER, 1);
+
+  h->key = strdup("x-amz-copy-source-if-match");
+  h->value = strdup(etag);
+
+  return h;
+}
+
 HTTP_HEADER *
 ctime_header(time_t t)
 {
@@ -576,44 +687,149 @@ get_etag_from_xml(char *xml)
   return etag;
 }
 
-static bool
-is_truncated(char *xml)
-{
-  if(strstr(xml, "<IsTruncated>true"))
-    return true;
+static char *
+xml_unescape(const char *s, size_t len)
+{
+  size_t i;
+  char *buf = g_malloc(len + 1);
+  char *d = buf;
+  static const char *entities[][2] = {
+    { "&amp;", "&" }, { "&lt;", "<" }, { "&gt;", ">" },
+    { "&quot;", "\"" }, { "&apos;", "'" }
+  };
 
-  return false;
+  while(len > 0) {
+    for(i = 0; i < G_N_ELEMENTS(entities); i++)
+      if(len >= strlen(entities[i][0]) &&
+          strncmp(s, entities[i][0], strlen(entities[i][0])) == 0)
+        break;
+
+    if(i < G_N_ELEMENTS(entities)) {
+      *d++ = entities[i][1][0];
+      len -= strlen(entities[i][0]);
+      s += strlen(entities[i][0]);
+    } else {
+      *d++ = *s++;
+      len--;
+    }
+  }
+  *d = '\0';
+
+  return buf;
 }
 
+/* end of the element p opens, or NULL while it is still arriving */
 static char *
-get_next_marker(char *xml)
+list_element_end(char *p, char *end, const char *close)
 {
-  char *start_marker = "NextMarker>";
-  char *end_marker  = "</NextMarker";
-  char *start_p, *end_p;
+  char *e;
 
-  start_p = strstr(xml, start_marker) + strlen(start_marker);
-  end_p   = strstr(xml, end_marker);
+  if((e = g_strstr_len(p, end - p, close)) == NULL)
+    return NULL;
 
-  return g_strndup(start_p, end_p - start_p);
+  return e + strlen(close);
 }
 
-static char *
-append_list_bucket_xml(char *xml, char *xml_to_append)
+static int
+list_parser_scan(struct list_parser *lp)
 {
-  char *append_pos, *to_append;
+  char *p = lp->buf, *e, *lt;
+  char *end = lp->buf + lp->len;
+  int result = 0;
 
-  // TODO: should be able to use a little less memory here.
-  xml = realloc(xml, sizeof(char) *
-      strlen(xml) + strlen(xml_to_append) + 1);
+  while(result == 0 && (lt = memchr(p, '<', end - p)) != NULL) {
+    p = lt;
 
-  append_pos = strstr(xml, "</ListBucket");
-  to_append  = strstr(xml_to_append, "<Contents");
+    if(strncmp(p, "<Contents>", strlen("<Contents>")) == 0) {
+      if((e = list_element_end(p, end, "</Contents>")) == NULL)
+        break;
 
-  *append_pos = '\0';
-  strncat(append_pos, to_append, strlen(to_append));
+      if(lp->entries++ >= lp->skip) {
+        char c = *e;
+        *e = '\0';
+        result = lp->fn(p, lp->data);
+        *e = c;
+      }
+    } else if(strncmp(p, "<IsTruncated>", strlen("<IsTruncated>")) == 0) {
+      if((e = list_element_end(p, end, "</IsTruncated>")) == NULL)
+        break;
+
+      lp->truncated = strncmp(p + strlen("<IsTruncated>"), "true", 4) == 0;
+    } else if(strncmp(p, "<NextMarker>", strlen("<NextMarker>")) == 0) {
+      if((e = list_element_end(p, end, "</NextMarker>")) == NULL)
+        break;
+
+      g_free(lp->marker);
+      lp->marker = xml_unescape(p + strlen("<NextMarker>"),
+          e - p - strlen("<NextMarker>") - strlen("</NextMarker>"));
+    } else {
+      /* any other tag, its text is skipped on the way to the next one */
+      if((e = memchr(p, '>', end - p)) == NULL)
+        break;
+      e++;
+    }
 
-  return xml;
+    p = e;
+  }
+
+  if(lt == NULL)
+    p = end;
+
+  lp->len = end - p;
+  memmove(lp->buf, p, lp->len);
+  lp->buf[lp->len] = '\0';
+
+  return result;
+}
+
+static size_t
+list_parser_cb(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t realsize = size * nmemb;
+  struct list_parser *lp = data;
+
+  if(lp->stopped)
+    return 0;
+
+  if(lp->len + realsize + 1 > lp->size) {
+    lp->size = MAX(lp->size * 2, lp->len + realsize + 1);
+    lp->buf = g_realloc(lp->buf, lp->size);
+  }
+
+  memcpy(lp->buf + lp->len, ptr, realsize);
+  lp->len += realsize;
+  lp->buf[lp->len] = '\0';
+
+  if(lp->held)
+    return realsize;
+
+  if(list_parser_scan(lp) != 0) {
+    lp->stopped = true;
+    return 0;
+  }
+
+  return realsize;
+}
+
+/* the pages before this one are done, parse what it buffered so far */
+static void
+list_parser_release(struct list_parser *lp)
+{
+  lp->held = false;
+  if(lp->len > 0 && list_parser_scan(lp) != 0)
+    lp->stopped = true;
+}
+
+/* start the page over, skipping the entries already handed out */
+static void
+list_parser_reset(struct list_parser *lp)
+{
+  lp->skip = MAX(lp->skip, lp->entries);
+  lp->entries = 0;
+  lp->len = 0;
+  lp->truncated = false;
+  g_free(lp->marker);
+  lp->marker = NULL;
 }
 
 char *
@@ -813,7 +1029,7 @@ stormfs_curl_easy_perform(CURL *c)
       break;
 
     attempts++;
-    curl_easy_perform(c);
+    code = curl_easy_perform(c);
   }
 
   return result;
@@ -988,13 +1204,14 @@ get_list_bucket_url(const char *path, const char *next_marker)
   int result;
   char *url;
   char *encoded_path = url_encode((char *) path);
+  char *encoded_marker = url_encode((char *) next_marker);
 
   if(strlen(path) > 1)
     result = asprintf(&url, "%s?delimiter=/&marker=%s&prefix=%s/",
-        curl.url, next_marker, encoded_path + 1);
+        curl.url, encoded_marker, encoded_path + 1);
   else
     result = asprintf(&url, "%s?delimiter=/&marker=%s&prefix=",
-        curl.url, next_marker);
+        curl.url, encoded_marker);
 
   if(result == -1) {
     fprintf(stderr, "unable to allocate memory\n");
@@ -1002,6 +1219,7 @@ get_list_bucket_url(const char *path, const char *next_marker)
   }
 
   free(encoded_path);
+  g_free(encoded_marker);
 
   return url;
 }
@@ -1043,6 +1261,55 @@ write_memory_cb(void *ptr, size_t size, size_t nmemb, void *data)
   return realsize;
 }
 
+static size_t
+write_range_cb(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t realsize = size * nmemb;
+  struct range_data *rd = data;
+  off_t offset = rd->whole ? 0 : rd->offset;
+
+  /* never write outside of the requested range */
+  if((off_t) realsize > rd->size - rd->written)
+    return 0;
+
+  if(pwrite(rd->fd, ptr, realsize, offset + rd->written) != (ssize_t) realsize)
+    return 0;
+
+  rd->written += realsize;
+
+  return realsize;
+}
+
+static size_t
+range_header_cb(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t realsize = size * nmemb;
+  char *h = ptr;
+  struct range_data *rd = data;
+
+  /* a new status line means the request is being retried,
+     start writing at the beginning of the range again */
+  if(realsize > 5 && strncmp(h, "HTTP/", 5) == 0) {
+    char *code = memchr(h, ' ', realsize);
+
+    rd->written = 0;
+    rd->whole = (code != NULL && strtol(code + 1, NULL, 10) == 200);
+  } else if(realsize > 14 && strncasecmp(h, "Content-Range:", 14) == 0) {
+    char *total = memchr(h, '/', realsize);
+
+    if(total != NULL && total[1] != '*')
+      rd->total = strtoll(total + 1, NULL, 10);
+  } else if(realsize > 15 && strncasecmp(h, "Content-Length:", 15) == 0) {
+    /* a 200 sends the whole object, make room for all of it */
+    if(rd->whole) {
+      rd->size  = strtoll(h + 15, NULL, 10);
+      rd->total = rd->size;
+    }
+  }
+
+  return realsize;
+}
+
 static int
 extract_meta(char *headers, GList **meta)
 {
@@ -1201,6 +1468,7 @@ release_pooled_handle(CURL *c)
     CURL_HANDLE *ch = head->data;
     if(ch->c == c) {
       curl_easy_reset(ch->c);
+      set_curl_defaults(ch->c);
       ch->in_use = false;
       curl.pool_full = false;
       is_pooled_handle = true;
@@ -1276,23 +1544,292 @@ stormfs_curl_get(const char *path, char **data)
   return result;
 }
 
-int
-stormfs_curl_get_file(const char *path, FILE *f)
+static int
+multi_wait(CURLM *multi)
+{
+  int max_fd = -1;
+  long curl_timeout = -1;
+  struct timeval timeout;
+
+  fd_set fd_r;
+  fd_set fd_w;
+  fd_set fd_e;
+  FD_ZERO(&fd_r);
+  FD_ZERO(&fd_w);
+  FD_ZERO(&fd_e);
+  timeout.tv_sec  = 1;
+  timeout.tv_usec = 0;
+
+  curl_multi_timeout(multi, &curl_timeout);
+  if(curl_timeout >= 0) {
+    timeout.tv_sec = curl_timeout / 1000;
+    if(timeout.tv_sec > 1)
+      timeout.tv_sec = 1;
+    else
+      timeout.tv_usec = (curl_timeout % 1000) * 1000;
+  }
+
+  if(curl_multi_fdset(multi, &fd_r, &fd_w, &fd_e, &max_fd) != CURLM_OK)
+    return -EIO;
+
+  if(select(max_fd + 1, &fd_r, &fd_w, &fd_e, &timeout) == -1)
+    return -errno;
+
+  return 0;
+}
+
+typedef CURL *(*transfer_start_fn)(void *transfer);
+typedef int (*transfer_finish_fn)(void *transfer, CURL *c, CURLcode code);
+
+/* run n transfers on a private multi handle with up to max of them in
+   flight. start configures a fresh attempt of a transfer and returns
+   its handle. finish releases the handle and returns 0, an error, or
+   -EAGAIN to retry the transfer on its own, up to CURL_RETRIES times.
+   Once a transfer fails, everything still in flight is abandoned. */
+static int
+multi_transfer(void **transfers, size_t n, size_t max,
+    transfer_start_fn start, transfer_finish_fn finish)
+{
+  int result = 0;
+  int running_handles = 0;
+  size_t i, n_running = 0, next = 0;
+  CURL **handles;
+  uint8_t *attempts;
+  CURLM *multi;
+
+  if(n == 0)
+    return 0;
+
+  // private multi handle, transfers run from many threads at once
+  if((multi = curl_multi_init()) == NULL)
+    return -EIO;
+
+  handles = g_new0(CURL *, n);
+  attempts = g_new0(uint8_t, n);
+
+  do {
+    CURLMsg *msg;
+    int remaining;
+
+    while(result == 0 && n_running < max && next < n) {
+      handles[next] = start(transfers[next]);
+      if(curl_multi_add_handle(multi, handles[next]) != CURLM_OK) {
+        finish(transfers[next], handles[next], CURLE_FAILED_INIT);
+        handles[next] = NULL;
+        result = -EIO;
+        break;
+      }
+
+      next++;
+      n_running++;
+    }
+
+    if(n_running == 0)
+      break;
+
+    curl_multi_perform(multi, &running_handles);
+    while((msg = curl_multi_info_read(multi, &remaining))) {
+      int err;
+
+      if(msg->msg != CURLMSG_DONE)
+        continue;
+
+      for(i = 0; i < next; i++)
+        if(handles[i] != NULL && handles[i] == msg->easy_handle)
+          break;
+
+      if(i == next)
+        continue;
+
+      curl_multi_remove_handle(multi, handles[i]);
+      err = finish(transfers[i], handles[i], msg->data.result);
+      handles[i] = NULL;
+      n_running--;
+
+      if(err == -EAGAIN && result == 0 && ++attempts[i] < CURL_RETRIES) {
+        handles[i] = start(transfers[i]);
+        if(curl_multi_add_handle(multi, handles[i]) == CURLM_OK) {
+          n_running++;
+          continue;
+        }
+
+        finish(transfers[i], handles[i], CURLE_FAILED_INIT);
+        handles[i] = NULL;
+        err = -EIO;
+      }
+
+      if(err != 0 && result == 0)
+        result = err;
+    }
+
+    if(result == 0 && n_running > 0 && running_handles > 0)
+      result = multi_wait(multi);
+
+    if(result == 0 && cancel != NULL && *cancel)
+      result = -ECANCELED;
+
+    // a transfer failed, abandon everything still in flight
+    if(result != 0) {
+      for(i = 0; i < next; i++) {
+        if(handles[i] == NULL)
+          continue;
+
+        curl_multi_remove_handle(multi, handles[i]);
+        finish(transfers[i], handles[i], CURLE_ABORTED_BY_CALLBACK);
+        handles[i] = NULL;
+      }
+      n_running = 0;
+    }
+  } while(n_running > 0 || (result == 0 && next < n));
+
+  g_free(handles);
+  g_free(attempts);
+  curl_multi_cleanup(multi);
+
+  return result;
+}
+
+static void
+range_part_init(RANGE_PART *rp, const char *path,
+    int fd, off_t offset, off_t size)
+{
+  rp->path = path;
+  rp->offset = offset;
+  rp->size = size;
+  rp->rd.fd = fd;
+
+  if(asprintf(&rp->range, "%jd-%jd",
+        (intmax_t) offset, (intmax_t) (offset + size - 1)) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static CURL *
+range_part_start(RANGE_PART *rp)
+{
+  CURL *c;
+  char *url = get_url(rp->path);
+
+  rp->rd.offset = rp->offset;
+  rp->rd.size = rp->size;
+  rp->rd.written = 0;
+  rp->rd.total = -1;
+  rp->rd.whole = false;
+
+  /* each attempt carries a fresh signature */
+  curl_slist_free_all(rp->headers);
+  rp->headers = NULL;
+
+  c = get_pooled_handle(url);
+  sign_request("GET", &rp->headers, rp->path);
+  curl_easy_setopt(c, CURLOPT_HTTPHEADER, rp->headers);
+  curl_easy_setopt(c, CURLOPT_RANGE, rp->range);
+  curl_easy_setopt(c, CURLOPT_HEADERDATA, (void *) &rp->rd);
+  curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, range_header_cb);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, (void *) &rp->rd);
+  curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_range_cb);
+  free(url);
+
+  return c;
+}
+
+static int
+range_part_finish(RANGE_PART *rp, CURL *c, CURLcode code)
+{
+  int result = http_response_errno(code, c);
+
+  if(result == 0 && rp->rd.written != rp->rd.size)
+    result = -EAGAIN;
+
+  release_pooled_handle(c);
+
+  return result;
+}
+
+static void
+range_part_free(RANGE_PART *rp)
+{
+  curl_slist_free_all(rp->headers);
+  free(rp->range);
+}
+
+/* download [offset, offset + size) of path into fd, split into
+   part_size ranges with up to curl.connections of them in flight */
+static int
+get_file_ranges(const char *path, int fd, off_t offset, off_t size)
 {
   int result;
-  HTTP_REQUEST *request = new_request(path);
+  size_t i, n_parts;
+  RANGE_PART *parts;
+  void **transfers;
 
-  sign_request("GET", &request->headers, path);
-  curl_easy_setopt(request->c, CURLOPT_WRITEDATA, f);
-  curl_easy_setopt(request->c, CURLOPT_HTTPHEADER, request->headers);
-  result = stormfs_curl_easy_perform(request->c);
+  if(size <= 0)
+    return 0;
 
-  rewind(f);
-  free_request(request);
+  n_parts = (size + curl.part_size - 1) / curl.part_size;
+  parts = g_new0(RANGE_PART, n_parts);
+  transfers = g_new0(void *, n_parts);
+  for(i = 0; i < n_parts; i++) {
+    off_t start = offset + (off_t) (i * curl.part_size);
+    off_t len = MIN((off_t) curl.part_size, offset + size - start);
+
+    range_part_init(&parts[i], path, fd, start, len);
+    transfers[i] = &parts[i];
+  }
+
+  result = multi_transfer(transfers, n_parts, curl.connections,
+      (transfer_start_fn) range_part_start,
+      (transfer_finish_fn) range_part_finish);
+
+  for(i = 0; i < n_parts; i++)
+    range_part_free(&parts[i]);
+  g_free(parts);
+  g_free(transfers);
 
   return result;
 }
 
+int
+stormfs_curl_get_file(const char *path, int fd)
+{
+  int result;
+  long http_response = 0;
+  CURL *c;
+  RANGE_PART first;
+
+  /* the first part tells us how large the object is,
+     the rest is fetched over parallel connections */
+  memset(&first, 0, sizeof(first));
+  range_part_init(&first, path, fd, 0, curl.part_size);
+  c = range_part_start(&first);
+  result = stormfs_curl_easy_perform(c);
+  curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &http_response);
+  release_pooled_handle(c);
+  range_part_free(&first);
+
+  // empty objects can't satisfy any range
+  if(result == -EIO && http_response == 416)
+    return 0;
+  if(result != 0)
+    return result;
+
+  if(first.rd.whole || first.rd.total < 0)
+    return (first.rd.written == first.rd.size || !first.rd.whole) ? 0 : -EIO;
+
+  if(first.rd.written != MIN(first.rd.size, first.rd.total))
+    return -EIO;
+
+  return get_file_ranges(path, fd, first.rd.written,
+      first.rd.total - first.rd.written);
+}
+
+int
+stormfs_curl_get_file_range(const char *path, int fd, off_t offset, size_t size)
+{
+  return get_file_ranges(path, fd, offset, size);
+}
+
 int
 stormfs_curl_head(const char *path, GList **headers)
 {
@@ -1448,168 +1985,551 @@ stormfs_curl_head_multi(const char *path, GList *files)
   return 0;
 }
 
-int
-stormfs_curl_list_bucket(const char *path, char **xml)
+static struct list_page *
+list_page_new(const char *marker, list_entry_fn fn, void *data)
 {
-  int result = -1;
-  char *marker = strdup("");
-  bool truncated = TRUE;
-
-  if (! marker)
-    return result;
+  struct list_page *pg = g_new0(struct list_page, 1);
 
-  while(truncated) {
-    char *url = get_list_bucket_url(path, marker);
-    CURL *c = get_pooled_handle(url);
-    struct curl_slist *req_headers = NULL;
-    HTTP_RESPONSE body;
+  pg->marker = strdup(marker);
+  pg->lp.fn = fn;
+  pg->lp.data = data;
+  pg->lp.held = true;
 
-    body.memory = g_malloc(1);
-    body.size = 0;
+  return pg;
+}
 
-    sign_request("GET", &req_headers, "/");
-    curl_easy_setopt(c, CURLOPT_HTTPHEADER, req_headers);
-    curl_easy_setopt(c, CURLOPT_WRITEDATA, (void *) &body);
-    curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_memory_cb);
+static int
+list_page_start(struct list_page *pg, CURLM *multi, const char *path)
+{
+  char *url = get_list_bucket_url(path, pg->marker);
 
-    result = stormfs_curl_easy_perform(c);
+  /* each attempt carries a fresh signature */
+  curl_slist_free_all(pg->headers);
+  pg->headers = NULL;
 
-    if(*xml == NULL)
-      *xml = strdup(body.memory);
-    else
-      *xml = append_list_bucket_xml(*xml, body.memory);
+  pg->c = get_pooled_handle(url);
+  sign_request("GET", &pg->headers, "/");
+  curl_easy_setopt(pg->c, CURLOPT_HTTPHEADER, pg->headers);
+  curl_easy_setopt(pg->c, CURLOPT_WRITEDATA, (void *) &pg->lp);
+  curl_easy_setopt(pg->c, CURLOPT_WRITEFUNCTION, list_parser_cb);
+  free(url);
 
-    if((truncated = is_truncated(body.memory)) == true) {
-      free(marker);
-      marker = get_next_marker(body.memory);
-    }
+  if(curl_multi_add_handle(multi, pg->c) != CURLM_OK) {
+    release_pooled_handle(pg->c);
+    pg->c = NULL;
+    return -EIO;
+  }
 
-    free(url);
-    free(body.memory);
-    release_pooled_handle(c);
-    curl_slist_free_all(req_headers);
+  return 0;
+}
+
+static void
+list_page_free(struct list_page *pg, CURLM *multi)
+{
+  if(pg == NULL)
+    return;
+
+  if(pg->c != NULL) {
+    curl_multi_remove_handle(multi, pg->c);
+    release_pooled_handle(pg->c);
+  }
+
+  curl_slist_free_all(pg->headers);
+  g_free(pg->lp.buf);
+  g_free(pg->lp.marker);
+  free(pg->marker);
+  g_free(pg);
+}
+
+static char *
+list_contents_key(const char *contents)
+{
+  const char *start_p, *end_p;
+
+  if((start_p = strstr(contents, "<Key>")) == NULL)
+    return NULL;
+  start_p += strlen("<Key>");
+
+  if((end_p = strstr(start_p, "</Key>")) == NULL)
+    return NULL;
+
+  return xml_unescape(start_p, end_p - start_p);
+}
+
+static int
+list_shard_entry(char *contents, void *data)
+{
+  struct list_shard *sh = data;
+
+  if(sh->end != NULL) {
+    char *key = list_contents_key(contents);
+    bool past_end = key != NULL && strcmp(key, sh->end) > 0;
+
+    g_free(key);
+    if(past_end)
+      return 1;
+  }
+
+  if(!sh->direct) {
+    g_queue_push_tail(&sh->held, g_strdup(contents));
+    return 0;
+  }
+
+  if(sh->fn(contents, sh->data) != 0) {
+    sh->stopped = true;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int
+list_shard_start(struct list_shard *sh, CURLM *multi, const char *path,
+    const char *marker)
+{
+  sh->cur = list_page_new(marker, list_shard_entry, sh);
+  sh->cur->lp.held = false;
+
+  return list_page_start(sh->cur, multi, path);
+}
+
+/* the shards before sh are done, hand over what it held back */
+static void
+list_shard_release(struct list_shard *sh)
+{
+  char *contents;
+
+  sh->direct = true;
+  while((contents = g_queue_pop_head(&sh->held)) != NULL) {
+    if(!sh->stopped && sh->fn(contents, sh->data) != 0)
+      sh->stopped = true;
+    g_free(contents);
   }
+}
+
+/* a shard waiting on the ones before it stops requesting pages once it
+   holds LIST_HELD_MAX entries */
+static bool
+list_shard_full(struct list_shard *sh)
+{
+  return !sh->direct && g_queue_get_length(&sh->held) >= LIST_HELD_MAX;
+}
+
+/* request the page after the one being parsed as soon as it is named */
+static int
+list_shard_ahead(struct list_shard *sh, CURLM *multi, const char *path)
+{
+  struct list_parser *lp;
+
+  if(sh->cur == NULL || sh->ahead != NULL || list_shard_full(sh))
+    return 0;
+
+  lp = &sh->cur->lp;
+  if(lp->stopped || lp->marker == NULL)
+    return 0;
+
+  if(sh->end != NULL && strcmp(lp->marker, sh->end) >= 0)
+    return 0;
+
+  sh->ahead = list_page_new(lp->marker, list_shard_entry, sh);
+
+  return list_page_start(sh->ahead, multi, path);
+}
+
+/* move on to the next page once the one being parsed is done */
+static int
+list_shard_advance(struct list_shard *sh, CURLM *multi, const char *path)
+{
+  int result = 0;
+
+  while(result == 0 && sh->cur != NULL && sh->cur->done) {
+    struct list_parser *lp = &sh->cur->lp;
+    bool more = !lp->stopped && lp->truncated && lp->marker != NULL;
+
+    if(more)
+      result = list_shard_ahead(sh, multi, path);
 
-  free(marker);
+    /* paused, the next page is requested once held is handed over */
+    if(more && sh->ahead == NULL && list_shard_full(sh) &&
+        (sh->end == NULL || strcmp(lp->marker, sh->end) < 0))
+      sh->next = g_strdup(lp->marker);
+
+    list_page_free(sh->cur, multi);
+    sh->cur = NULL;
+
+    if(more && sh->ahead != NULL) {
+      sh->cur = sh->ahead;
+      sh->ahead = NULL;
+      list_parser_release(&sh->cur->lp);
+    } else {
+      list_page_free(sh->ahead, multi);
+      sh->ahead = NULL;
+    }
+  }
 
   return result;
 }
 
+/* go on listing a paused shard once what it held is handed over */
 static int
-upload_part(const char *path, FILE_PART *fp)
+list_shard_resume(struct list_shard *sh, CURLM *multi, const char *path)
 {
   int result;
-  FILE *f;
-  CURL *c;
-  char *url;
-  char *sign_path;
-  HTTP_RESPONSE response;
-  struct curl_slist *req_headers = NULL;
-  struct stat st;
-  GList *headers = NULL, *head = NULL, *next = NULL;
+  char *marker = sh->next;
 
-  if(fstat(fp->fd, &st) != 0) {
-    perror("fstat");
-    return -errno;
+  if(marker == NULL || sh->cur != NULL || sh->stopped || list_shard_full(sh))
+    return 0;
+
+  sh->next = NULL;
+  result = list_shard_start(sh, multi, path, marker);
+  g_free(marker);
+
+  return result;
+}
+
+static void
+list_shard_free(struct list_shard *sh, CURLM *multi)
+{
+  char *contents;
+
+  list_page_free(sh->cur, multi);
+  list_page_free(sh->ahead, multi);
+  while((contents = g_queue_pop_head(&sh->held)) != NULL)
+    g_free(contents);
+  g_free(sh->next);
+  g_free(sh->end);
+}
+
+/* once the first page names its marker, split the keys after it between
+   up to list_shards shards on the first character of their names */
+static int
+list_split(struct list_shard *shards, size_t *n, CURLM *multi,
+    const char *path, const char *marker)
+{
+  size_t i;
+  int c0, last;
+  int result = 0;
+  char *prefix = (strlen(path) > 1) ? g_strdup_printf("%s/", path + 1)
+                                    : g_strdup("");
+  size_t prefix_len = strlen(prefix);
+
+  if(strncmp(marker, prefix, prefix_len) != 0) {
+    g_free(prefix);
+    return 0;
   }
 
-  if(lseek(fp->fd, 0, SEEK_SET) == -1) {
-    perror("lseek");
-    return -errno;
+  c0 = last = (unsigned char) marker[prefix_len];
+  for(i = 1; result == 0 && c0 != 0 && i < curl.list_shards; i++) {
+    struct list_shard *sh = &shards[*n];
+    int c = c0 + (LIST_SPLIT_LAST - c0) * (int) i / (int) curl.list_shards;
+
+    if(c <= last)
+      continue;
+    last = c;
+
+    /* each shard ends with the key the next one starts after */
+    shards[*n - 1].end = g_strdup_printf("%s%c", prefix, c);
+    sh->fn = shards[0].fn;
+    sh->data = shards[0].data;
+    g_queue_init(&sh->held);
+    (*n)++;
+
+    result = list_shard_start(sh, multi, path, shards[*n - 2].end);
   }
 
-  if((f = fdopen(fp->fd, "rb")) == NULL) {
-    perror("fdopen");
-    return -errno;
+  g_free(prefix);
+
+  return result;
+}
+
+/* hand every entry under path to fn in order. The next page is requested
+   as soon as the page being parsed names its NextMarker, which comes
+   before its entries, and is buffered until that page is done. With
+   list_shards, a directory that doesn't fit in one page is split into
+   key ranges listed in parallel, later ranges hold their entries until
+   the ones before them are done, pausing once they hold LIST_HELD_MAX. */
+int
+stormfs_curl_list_bucket(const char *path, list_entry_fn fn, void *data)
+{
+  int result = 0;
+  int running_handles = 0;
+  bool split = curl.list_shards <= 1;
+  size_t i, first = 0, n_shards = 1;
+  struct list_shard *shards;
+  CURLM *multi;
+
+  // private multi handle, listings run from many threads at once
+  if((multi = curl_multi_init()) == NULL)
+    return -EIO;
+
+  shards = g_new0(struct list_shard, MAX(curl.list_shards, 1));
+  shards[0].fn = fn;
+  shards[0].data = data;
+  shards[0].direct = true;
+  g_queue_init(&shards[0].held);
+  result = list_shard_start(&shards[0], multi, path, "");
+
+  while(result == 0 && first < n_shards) {
+    CURLMsg *msg;
+    int remaining;
+
+    curl_multi_perform(multi, &running_handles);
+    while((msg = curl_multi_info_read(multi, &remaining))) {
+      int err;
+      struct list_page *pg = NULL;
+
+      if(msg->msg != CURLMSG_DONE)
+        continue;
+
+      for(i = first; pg == NULL && i < n_shards; i++) {
+        if(shards[i].cur != NULL && msg->easy_handle == shards[i].cur->c)
+          pg = shards[i].cur;
+        else if(shards[i].ahead != NULL &&
+            msg->easy_handle == shards[i].ahead->c)
+          pg = shards[i].ahead;
+      }
+
+      if(pg == NULL)
+        continue;
+
+      err = pg->lp.stopped ? 0 : http_response_errno(msg->data.result, pg->c);
+      curl_multi_remove_handle(multi, pg->c);
+      release_pooled_handle(pg->c);
+      pg->c = NULL;
+
+      if(err == -EAGAIN && ++pg->attempts < CURL_RETRIES) {
+        list_parser_reset(&pg->lp);
+        err = list_page_start(pg, multi, path);
+      } else if(err == 0)
+        pg->done = true;
+
+      if(err != 0 && result == 0)
+        result = err;
+    }
+
+    for(i = first; result == 0 && i < n_shards; i++)
+      result = list_shard_advance(&shards[i], multi, path);
+
+    /* hand over to the next shard once the ones before it are done */
+    while(result == 0 && first < n_shards && shards[first].cur == NULL &&
+        shards[first].next == NULL && !shards[first].stopped)
+      if(++first < n_shards)
+        list_shard_release(&shards[first]);
+
+    if(result != 0 || first == n_shards || shards[first].stopped)
+      break;
+
+    if(!split && shards[0].cur != NULL && shards[0].cur->lp.marker != NULL) {
+      split = true;
+      result = list_split(shards, &n_shards, multi, path,
+          shards[0].cur->lp.marker);
+    }
+
+    for(i = first; result == 0 && i < n_shards; i++)
+      if((result = list_shard_resume(&shards[i], multi, path)) == 0)
+        result = list_shard_ahead(&shards[i], multi, path);
+
+    if(result == 0 && running_handles > 0)
+      result = multi_wait(multi);
   }
 
-  response.memory = malloc(1);
-  response.size = 0;
-  url = get_upload_part_url(path, fp);
-  c = get_pooled_handle(url);
+  for(i = 0; i < n_shards; i++)
+    list_shard_free(&shards[i], multi);
+  g_free(shards);
+  curl_multi_cleanup(multi);
+
+  return result;
+}
+
+static size_t
+read_part_cb(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  ssize_t n;
+  FILE_PART *fp = data;
+  size_t len = MIN(size * nmemb, fp->size - fp->sent);
+
+  if(len == 0)
+    return 0;
+
+  if((n = pread(fp->fd, ptr, len, fp->offset + fp->sent)) <= 0)
+    return CURL_READFUNC_ABORT;
+
+  fp->sent += n;
+
+  return n;
+}
+
+static CURL *
+upload_part_start(FILE_PART *fp)
+{
+  CURL *c;
+  char *url;
+  char *sign_path;
+
+  /* every attempt re-reads the part from its start */
+  fp->sent = 0;
+  g_free(fp->response.memory);
+  fp->response.memory = g_malloc(1);
+  fp->response.size = 0;
+  curl_slist_free_all(fp->headers);
+  fp->headers = NULL;
 
   if(asprintf(&sign_path, "%s?partNumber=%d&uploadId=%s",
-      path, fp->part_num, fp->upload_id) == -1) {
+      fp->object, fp->part_num, fp->upload_id) == -1) {
     fprintf(stderr, "unable to allocate memory\n");
     exit(EXIT_FAILURE);
   }
 
-  sign_request("PUT", &req_headers, sign_path);
-  curl_easy_setopt(c, CURLOPT_INFILE, f);
+  url = get_upload_part_url(fp->object, fp);
+  c = get_pooled_handle(url);
+  sign_request("PUT", &fp->headers, sign_path);
+  curl_easy_setopt(c, CURLOPT_READDATA, (void *) fp);
+  curl_easy_setopt(c, CURLOPT_READFUNCTION, read_part_cb);
   curl_easy_setopt(c, CURLOPT_UPLOAD, 1L);
-  curl_easy_setopt(c, CURLOPT_INFILESIZE_LARGE, (curl_off_t) st.st_size);
-  curl_easy_setopt(c, CURLOPT_HTTPHEADER, req_headers);
-  curl_easy_setopt(c, CURLOPT_HEADERDATA, (void *) &response);
+  curl_easy_setopt(c, CURLOPT_INFILESIZE_LARGE, (curl_off_t) fp->size);
+  curl_easy_setopt(c, CURLOPT_HTTPHEADER, fp->headers);
+  curl_easy_setopt(c, CURLOPT_HEADERDATA, (void *) &fp->response);
   curl_easy_setopt(c, CURLOPT_HEADERFUNCTION, write_memory_cb);
-  result = stormfs_curl_easy_perform(c);
 
-  extract_meta(response.memory, &headers);
+  free(url);
+  free(sign_path);
 
-  head = g_list_first(headers);
-  while(head != NULL) {
-    next = head->next;
-    HTTP_HEADER *h = head->data;
-    if(strstr(h->key, "ETag") != NULL) {
-      fp->etag = strdup(h->value);
-      break;
-    }
+  return c;
+}
 
-    head = next;
-  }
+static int
+upload_part_finish(FILE_PART *fp, CURL *c, CURLcode code)
+{
+  int result = http_response_errno(code, c);
+  GList *headers = NULL;
 
-  free(url);
-  free(sign_path);
-  free(response.memory);
-  free_headers(headers);
-  curl_slist_free_all(req_headers);
   release_pooled_handle(c);
+  if(result != 0)
+    return result;
+
+  extract_meta(fp->response.memory, &headers);
+  free(fp->etag);
+  if((fp->etag = headers_to_etag(headers)) == NULL)
+    result = -EAGAIN;
+
+  free_headers(headers);
 
   return result;
 }
 
-static int
-copy_part(const char *from, const char *to, GList *headers, FILE_PART *fp)
+static CURL *
+copy_part_start(FILE_PART *fp)
 {
-  int result;
   CURL *c;
   char *url;
   char *sign_path;
-  HTTP_RESPONSE response;
-  struct curl_slist *req_headers = NULL;
-  GList *response_headers = NULL, *stripped_headers = NULL;
+  GList *headers = NULL;
 
-  response.memory = malloc(1);
-  response.size = 0;
-  url = get_upload_part_url(to, fp);
-  c = get_pooled_handle(url);
+  g_free(fp->response.memory);
+  fp->response.memory = g_malloc(1);
+  fp->response.size = 0;
+  curl_slist_free_all(fp->headers);
+
+  headers = add_header(headers, copy_source_header(fp->source));
+  headers = add_header(headers, copy_source_range_header(fp->offset,
+        fp->offset + fp->size - 1));
+  if(fp->source_etag != NULL)
+    headers = add_header(headers, copy_source_if_match_header(fp->source_etag));
+  fp->headers = headers_to_curl_slist(headers);
+  free_headers(g_list_first(headers));
 
   if(asprintf(&sign_path, "%s?partNumber=%d&uploadId=%s",
-      to, fp->part_num, fp->upload_id) == -1) {
+      fp->object, fp->part_num, fp->upload_id) == -1) {
     fprintf(stderr, "unable to allocate memory\n");
     exit(EXIT_FAILURE);
   }
 
-  headers = g_list_first(headers);
-  stripped_headers = g_list_copy(headers);
-  stripped_headers = strip_header(stripped_headers, "x-amz-meta");
-  req_headers = headers_to_curl_slist(stripped_headers);
-
-  sign_request("PUT", &req_headers, sign_path);
+  url = get_upload_part_url(fp->object, fp);
+  c = get_pooled_handle(url);
+  sign_request("PUT", &fp->headers, sign_path);
   curl_easy_setopt(c, CURLOPT_UPLOAD, 1L);
   curl_easy_setopt(c, CURLOPT_INFILESIZE, 0);
-  curl_easy_setopt(c, CURLOPT_HTTPHEADER, req_headers);
-  curl_easy_setopt(c, CURLOPT_WRITEDATA, (void *) &response);
+  curl_easy_setopt(c, CURLOPT_HTTPHEADER, fp->headers);
+  curl_easy_setopt(c, CURLOPT_WRITEDATA, (void *) &fp->response);
   curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, write_memory_cb);
-  result = stormfs_curl_easy_perform(c);
-
-  fp->etag = get_etag_from_xml(response.memory);
 
   free(url);
   free(sign_path);
-  free(response.memory);
-  free_headers(response_headers);
-  curl_slist_free_all(req_headers);
+
+  return c;
+}
+
+static int
+copy_part_finish(FILE_PART *fp, CURL *c, CURLcode code)
+{
+  int result = http_response_errno(code, c);
+
   release_pooled_handle(c);
+  if(result != 0)
+    return result;
+
+  /* copies can fail after the 200 went out, retry those */
+  if(strstr(fp->response.memory, "<ETag>") == NULL)
+    return -EAGAIN;
+
+  free(fp->etag);
+  fp->etag = get_etag_from_xml(fp->response.memory);
+
+  return 0;
+}
+
+/* parts with a source are copied server side, the rest are read
+   from their fd */
+static CURL *
+part_start(FILE_PART *fp)
+{
+  if(fp->source != NULL)
+    return copy_part_start(fp);
+
+  return upload_part_start(fp);
+}
+
+/* journaled parts aren't sent again when their upload is resumed */
+static void
+journal_record(FILE *j, FILE_PART *fp)
+{
+  fprintf(j, "%d %s\n", fp->part_num, fp->etag);
+  if(fflush(j) != 0 || fdatasync(fileno(j)) != 0)
+    perror("journal");
+}
+
+static int
+part_finish(FILE_PART *fp, CURL *c, CURLcode code)
+{
+  int result;
+
+  if(fp->source != NULL)
+    result = copy_part_finish(fp, c, code);
+  else
+    result = upload_part_finish(fp, c, code);
+
+  if(result == 0 && fp->journal != NULL)
+    journal_record(fp->journal, fp);
+
+  return result;
+}
+
+/* send every part, up to upload_connections of them at once */
+static int
+put_parts(GList *parts)
+{
+  int result;
+  size_t i, n_parts = g_list_length(parts);
+  void **transfers = g_new0(void *, n_parts);
+  GList *head = NULL;
+
+  for(i = 0, head = g_list_first(parts); head != NULL; i++, head = head->next)
+    transfers[i] = head->data;
+
+  result = multi_transfer(transfers, n_parts, curl.upload_connections,
+      (transfer_start_fn) part_start, (transfer_finish_fn) part_finish);
+
+  g_free(transfers);
 
   return result;
 }
@@ -1664,9 +2584,10 @@ complete_multipart_xml(GList *parts)
   return xml;
 }
 
+/* etag, when not NULL, is set to the ETag of the new object */
 static int
 complete_multipart(const char *path, char *upload_id,
-    GList *headers, GList *parts)
+    GList *headers, GList *parts, char **etag)
 {
   int result;
   CURL *c;
@@ -1679,7 +2600,7 @@ complete_multipart(const char *path, char *upload_id,
   struct post_data pd;
   GList *stripped_headers = NULL;
 
-  body.memory = g_malloc(1);
+  body.memory = g_malloc0(1);
   body.size = 0;
 
   pd.readptr = post;
@@ -1708,6 +2629,9 @@ complete_multipart(const char *path, char *upload_id,
 
   result = stormfs_curl_easy_perform(c);
 
+  if(result == 0 && etag != NULL && strstr(body.memory, "<ETag>") != NULL)
+    *etag = get_etag_from_xml(body.memory);
+
   free(url);
   free(sign_path);
   free(xml);
@@ -1716,7 +2640,180 @@ complete_multipart(const char *path, char *upload_id,
   curl_slist_free_all(req_headers);
   release_pooled_handle(c);
 
-  return 0;
+  return result;
+}
+
+static int
+abort_multipart(const char *path, char *upload_id)
+{
+  int result;
+  CURL *c;
+  char *url;
+  char *sign_path;
+  struct curl_slist *req_headers = NULL;
+
+  if(asprintf(&sign_path, "%s?uploadId=%s", path, upload_id) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  url = get_complete_multipart_url(path, upload_id);
+  c = get_pooled_handle(url);
+
+  sign_request("DELETE", &req_headers, sign_path);
+  curl_easy_setopt(c, CURLOPT_CUSTOMREQUEST, "DELETE");
+  curl_easy_setopt(c, CURLOPT_HTTPHEADER, req_headers);
+  result = stormfs_curl_easy_perform(c);
+
+  free(url);
+  free(sign_path);
+  curl_slist_free_all(req_headers);
+  release_pooled_handle(c);
+
+  return result;
+}
+
+struct journal {
+  char *path;           /* object being uploaded */
+  char *upload_id;
+  off_t size;           /* size of the file being uploaded */
+  struct timespec mtime; /* mtime of the file being uploaded */
+  size_t part_size;
+  GList *parts;         /* parts completed so far */
+};
+
+static char *
+journal_path(const char *path)
+{
+  char *file;
+  gchar *sum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, path, -1);
+
+  if(asprintf(&file, "%s/%s", curl.journal_dir, sum) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  g_free(sum);
+
+  return file;
+}
+
+static void
+journal_free(struct journal *j)
+{
+  free(j->path);
+  free(j->upload_id);
+  free_parts(j->parts);
+  g_free(j);
+}
+
+/* read a journal back, ignoring a torn last line */
+static struct journal *
+journal_load(const char *file)
+{
+  FILE *f;
+  ssize_t n;
+  int line_num = 0;
+  size_t len = 0;
+  char *line = NULL;
+  intmax_t size, sec;
+  long nsec;
+  struct journal *j;
+
+  if((f = fopen(file, "r")) == NULL)
+    return NULL;
+
+  j = g_new0(struct journal, 1);
+  while((n = getline(&line, &len, f)) > 0 && line[n - 1] == '\n') {
+    line[n - 1] = '\0';
+
+    switch(line_num++) {
+      case 0:
+        if(strcmp(line, JOURNAL_MAGIC) != 0)
+          goto invalid;
+        break;
+      case 1:
+        j->path = strdup(line);
+        break;
+      case 2:
+        j->upload_id = strdup(line);
+        break;
+      case 3:
+        if(sscanf(line, "%jd %jd %ld %zu",
+              &size, &sec, &nsec, &j->part_size) != 4)
+          goto invalid;
+        j->size = size;
+        j->mtime.tv_sec = sec;
+        j->mtime.tv_nsec = nsec;
+        break;
+      default: {
+        FILE_PART *fp;
+        char *etag = strchr(line, ' ');
+
+        if(etag == NULL)
+          goto invalid;
+
+        fp = create_part(atoi(line), j->upload_id);
+        fp->etag = strdup(etag + 1);
+        j->parts = g_list_prepend(j->parts, fp);
+      }
+    }
+  }
+
+  if(line_num < 4)
+    goto invalid;
+
+  free(line);
+  fclose(f);
+
+  return j;
+
+invalid:
+  free(line);
+  fclose(f);
+  journal_free(j);
+
+  return NULL;
+}
+
+static bool
+journal_matches(struct journal *j, const char *path,
+    const struct stat *st, size_t part_size)
+{
+  return strcmp(j->path, path) == 0 &&
+    j->size == st->st_size &&
+    j->mtime.tv_sec == st->st_mtim.tv_sec &&
+    j->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+    j->part_size == part_size;
+}
+
+/* forget a journal, aborting the upload it recorded */
+static void
+journal_discard(const char *file, struct journal *j)
+{
+  if(j != NULL)
+    abort_multipart(j->path, j->upload_id);
+
+  unlink(file);
+}
+
+static FILE *
+journal_create(const char *file, const char *path,
+    const char *upload_id, const struct stat *st, size_t part_size)
+{
+  FILE *j;
+
+  if((j = fopen(file, "w")) == NULL) {
+    perror("fopen");
+    return NULL;
+  }
+
+  fprintf(j, "%s\n%s\n%s\n%jd %jd %ld %zu\n", JOURNAL_MAGIC, path, upload_id,
+      (intmax_t) st->st_size, (intmax_t) st->st_mtim.tv_sec,
+      (long) st->st_mtim.tv_nsec, part_size);
+  if(fflush(j) != 0 || fdatasync(fileno(j)) != 0)
+    perror("journal");
+
+  return j;
 }
 
 static char *
@@ -1768,37 +2865,65 @@ init_multipart(const char *path, off_t size, GList *headers)
   return upload_id;
 }
 
+/* parts large enough to give every connection a few of them, no
+   smaller than min and few enough to stay under MAX_PARTS */
+static size_t
+part_size(off_t size, off_t min)
+{
+  off_t part_size = size /
+    (off_t) (curl.upload_connections * PARTS_PER_CONNECTION);
+
+  part_size = MAX(part_size, min);
+  part_size = MAX(part_size, (size + MAX_PARTS - 1) / MAX_PARTS);
+
+  return MIN(part_size, FIVE_GB);
+}
+
+/* part size of an upload of size bytes */
+size_t
+stormfs_curl_part_size(off_t size)
+{
+  return part_size(size, curl.upload_part_size);
+}
+
+/* copies run server side, there is little point in small parts */
+static size_t
+copy_part_size(off_t size)
+{
+  return part_size(size, MULTIPART_COPY_MIN);
+}
+
 static GList *
-create_copy_parts(const char *path, char *upload_id, off_t size)
+create_copy_parts(const char *from, const char *to,
+    char *upload_id, off_t size)
 {
   int part_num = 1;
-  off_t bytes_remaining;
+  off_t offset;
+  size_t part_size = copy_part_size(size);
   GList *parts = NULL;
 
-  bytes_remaining = size;
-  while(bytes_remaining > 0) {
-    FILE_PART *fp = create_part(part_num, upload_id);
+  for(offset = 0; offset < size; offset += part_size) {
+    FILE_PART *fp = create_part(part_num++, upload_id);
 
-    fp->path = strdup(path);
-    if(bytes_remaining > MULTIPART_COPY_SIZE)
-      fp->size = MULTIPART_COPY_SIZE;
-    else
-      fp->size = bytes_remaining;
+    fp->object = to;
+    fp->source = from;
+    fp->offset = offset;
+    fp->size = MIN((off_t) part_size, size - offset);
 
     parts = g_list_append(parts, fp);
-    part_num++;
-    bytes_remaining = bytes_remaining - fp->size;
   }
 
   return parts;
 }
 
+/* parts are read straight from fd at their offset while uploading */
 static GList *
 create_file_parts(const char *path, char *upload_id, int fd)
 {
-  FILE *f;
+  int part_num = 1;
+  off_t offset = 0;
+  size_t part_size;
   struct stat st;
-  size_t bytes_remaining;
   GList *parts = NULL;
 
   if(fstat(fd, &st) != 0) {
@@ -1806,48 +2931,17 @@ create_file_parts(const char *path, char *upload_id, int fd)
     return NULL;
   }
 
-  if((f = fdopen(fd, "rb")) == NULL) {
-    perror("fdopen");
-    return NULL;
-  }
-
-  int part_num = 1;
-  bytes_remaining = st.st_size;
-  while(bytes_remaining > 0) {
-    char *buf = NULL;
-    size_t nbytes;
-    FILE *tmp_f;
+  part_size = stormfs_curl_part_size(st.st_size);
+  while(offset < st.st_size) {
     FILE_PART *fp = create_part(part_num, upload_id);
 
-    if(bytes_remaining > MULTIPART_CHUNK)
-      fp->size = MULTIPART_CHUNK;
-    else
-      fp->size = bytes_remaining;
-
-    if((buf = malloc(sizeof(char) * fp->size)) == NULL) {
-      perror("malloc");
-      return NULL;
-    }
-
-    if((tmp_f = fdopen(fp->fd, "wb")) == NULL) {
-      perror("fdopen");
-      free(buf);
-      return NULL;
-    }
-
-    if((nbytes = fread(buf, 1, fp->size, f)) != fp->size) {
-      free(buf);
-      return NULL;
-    }
-
-    nbytes = fwrite(buf, 1, fp->size, tmp_f);
-    free(buf);
-    if(nbytes != fp->size)
-      return NULL;
+    fp->fd = fd;
+    fp->offset = offset;
+    fp->size = MIN((off_t) part_size, st.st_size - offset);
 
     parts = g_list_append(parts, fp);
     part_num++;
-    bytes_remaining = bytes_remaining - fp->size;
+    offset += fp->size;
   }
 
   return parts;
@@ -1858,88 +2952,383 @@ copy_multipart(const char *from, const char *to, GList *headers, off_t size)
 {
   int result;
   char *upload_id = NULL;
-  GList *parts = NULL, *head = NULL, *next = NULL;
+  GList *parts = NULL;
 
   if((upload_id = init_multipart(to, size, headers)) == NULL)
     return -EIO;
 
-  if((parts = create_copy_parts(to, upload_id, size)) == NULL)
-    return -EIO;
-
-  off_t bytes_written = 0;
-  head = g_list_first(parts);
-  while(head != NULL) {
-    next = head->next;
-    FILE_PART *fp = head->data;
-    off_t first = bytes_written;
-    off_t last = bytes_written + (fp->size - 1);
-    headers = add_header(headers, copy_meta_header());
-    headers = add_header(headers, copy_source_header(from));
-    headers = add_header(headers, copy_source_range_header(first, last));
-
-    if((result = copy_part(from, to, headers, fp)) != 0)
-      break;
-
-    bytes_written = last + 1;
-    head = next;
-  }
+  /* parts are copied concurrently, a failed part is retried on its own */
+  parts = create_copy_parts(from, to, upload_id, size);
+  if((result = put_parts(parts)) == 0)
+    result = complete_multipart(to, upload_id, headers, parts, NULL);
+  if(result != 0)
+    abort_multipart(to, upload_id);
 
-  result = complete_multipart(to, upload_id, headers, parts);
   free_parts(parts);
+  free(upload_id);
 
   return result;
 }
 
+/* the journal records source, the file fd was copied from, or fd
+   itself when source is NULL */
 static int
-upload_multipart(const char *path, GList *headers, int fd)
+upload_multipart(const char *path, GList *headers, int fd,
+    const struct stat *source, char **etag)
 {
   int result;
   struct stat st;
+  size_t part_size;
   char *upload_id = NULL;
-  GList *parts = NULL, *head = NULL, *next = NULL;
+  char *file = journal_path(path);
+  FILE *journal = NULL;
+  struct journal *j;
+  GList *parts = NULL, *pending = NULL, *head = NULL, *done = NULL;
 
   if(fstat(fd, &st) != 0) {
     perror("fstat");
+    free(file);
     return -errno;
   }
 
-  if(lseek(fd, 0, SEEK_SET) == -1) {
-    perror("lseek");
-    return -errno;
+  if(source == NULL)
+    source = &st;
+
+  /* pick up an interrupted upload of the same contents */
+  part_size = stormfs_curl_part_size(st.st_size);
+  if((j = journal_load(file)) != NULL) {
+    if(journal_matches(j, path, source, part_size)) {
+      upload_id = strdup(j->upload_id);
+      journal = fopen(file, "a");
+    } else {
+      journal_discard(file, j);
+      journal_free(j);
+      j = NULL;
+    }
   }
 
-  if((upload_id = init_multipart(path, st.st_size, headers)) == NULL)
-    return -EIO;
+  if(upload_id == NULL) {
+    if((upload_id = init_multipart(path, st.st_size, headers)) == NULL) {
+      free(file);
+      return -EIO;
+    }
 
-  if((parts = create_file_parts(path, upload_id, fd)) == NULL)
-    return -EIO;
+    journal = journal_create(file, path, upload_id, source, part_size);
+  }
 
-  head = g_list_first(parts);
-  while(head != NULL) {
-    next = head->next;
+  if((parts = create_file_parts(path, upload_id, fd)) == NULL) {
+    result = -EIO;
+    goto out;
+  }
+
+  for(head = g_list_first(parts); head != NULL; head = head->next) {
     FILE_PART *fp = head->data;
-    result = upload_part(path, fp);
-    close(fp->fd);
-    unlink(fp->path);
-    if(result != 0)
-      break;
 
-    head = next;
+    fp->object = path;
+    fp->journal = journal;
+
+    for(done = (j != NULL) ? j->parts : NULL; done != NULL; done = done->next)
+      if(((FILE_PART *) done->data)->part_num == fp->part_num)
+        break;
+
+    if(done != NULL)
+      fp->etag = strdup(((FILE_PART *) done->data)->etag);
+    else
+      pending = g_list_append(pending, fp);
   }
 
+  /* parts go up concurrently, a failed part is retried on its own */
+  result = put_parts(pending);
+  g_list_free(pending);
+
+  if(result == 0)
+    result = complete_multipart(path, upload_id, headers, parts, etag);
+
+out:
+  if(journal != NULL)
+    fclose(journal);
+
+  /* uploads that ran out of retries are resumed by the next attempt,
+     anything else starts over */
+  if(result != -EAGAIN)
+    journal_discard(file, NULL);
+  if(result != 0 && result != -EAGAIN)
+    abort_multipart(path, upload_id);
+
+  if(j != NULL)
+    journal_free(j);
+  free_parts(parts);
+  free(upload_id);
+  free(file);
+
+  return result;
+}
+
+static gint
+cmp_part_num(FILE_PART *a, FILE_PART *b)
+{
+  return a->part_num - b->part_num;
+}
+
+static GList *
+copy_headers(GList *headers)
+{
+  GList *head = NULL, *copy = NULL;
+
+  for(head = g_list_first(headers); head != NULL; head = head->next) {
+    HTTP_HEADER *h = head->data;
+    HTTP_HEADER *dup = g_new(HTTP_HEADER, 1);
+
+    dup->key = strdup(h->key);
+    dup->value = strdup(h->value);
+    copy = g_list_append(copy, dup);
+  }
+
+  return copy;
+}
+
+static void
+free_multipart(struct multipart *mp)
+{
+  free(mp->path);
+  free(mp->upload_id);
+  free_headers(mp->headers);
+  free_parts(mp->parts);
+  pthread_mutex_destroy(&mp->lock);
+  g_free(mp);
+}
+
+/* start a multipart upload whose parts are sent as they become
+   available, possibly out of order and from several threads */
+struct multipart *
+stormfs_curl_multipart_init(const char *path, GList *headers)
+{
+  char *upload_id;
+  struct multipart *mp;
+
+  if((upload_id = init_multipart(path, 0, headers)) == NULL)
+    return NULL;
+
+  mp = g_new0(struct multipart, 1);
+  mp->path = strdup(path);
+  mp->upload_id = upload_id;
+  mp->headers = copy_headers(headers);
+  pthread_mutex_init(&mp->lock, NULL);
+
+  return mp;
+}
+
+int
+stormfs_curl_multipart_put(struct multipart *mp, int part_num,
+    int fd, off_t offset, size_t size)
+{
+  int result;
+  void *transfer;
+  FILE_PART *fp = create_part(part_num, mp->upload_id);
+
+  fp->fd = fd;
+  fp->offset = offset;
+  fp->size = size;
+  fp->object = mp->path;
+  transfer = fp;
+
+  result = multi_transfer(&transfer, 1, 1,
+      (transfer_start_fn) upload_part_start,
+      (transfer_finish_fn) upload_part_finish);
   if(result != 0) {
-    free_parts(parts);
+    free_part(fp);
     return result;
   }
 
-  result = complete_multipart(path, upload_id, headers, parts);
+  pthread_mutex_lock(&mp->lock);
+  mp->parts = g_list_insert_sorted(mp->parts, fp,
+      (GCompareFunc) cmp_part_num);
+  pthread_mutex_unlock(&mp->lock);
+
+  return 0;
+}
+
+/* finish the upload from the parts put so far, aborting it when that
+   fails. mp is freed either way. */
+int
+stormfs_curl_multipart_complete(struct multipart *mp, char **etag)
+{
+  int result;
+
+  result = complete_multipart(mp->path, mp->upload_id, mp->headers,
+      mp->parts, etag);
+  if(result != 0)
+    abort_multipart(mp->path, mp->upload_id);
+
+  free_multipart(mp);
+
+  return result;
+}
+
+/* throw away the parts put so far and free mp */
+void
+stormfs_curl_multipart_abort(struct multipart *mp)
+{
+  if(abort_multipart(mp->path, mp->upload_id) != 0)
+    fprintf(stderr, "stormfs: unable to abort upload of %s\n", mp->path);
+
+  free_multipart(mp);
+}
+
+
+static bool
+extents_overlap(GList *extents, off_t offset, off_t size)
+{
+  GList *head = NULL;
+
+  for(head = g_list_first(extents); head != NULL; head = head->next) {
+    struct extent *e = head->data;
+
+    if(e->offset < offset + size && offset < e->offset + e->size)
+      return true;
+  }
+
+  return false;
+}
+
+/* upload fd over an object with the given ETag, sending only the parts
+   overlapping dirty extents. Every other part is copied server side
+   from the object itself, which must not have changed meanwhile. */
+int
+stormfs_curl_upload_update(const char *path, GList *headers, int fd,
+    const char *etag, GList *dirty, char **new_etag)
+{
+  int result;
+  int part_num = 1;
+  off_t offset;
+  size_t part_size;
+  struct stat st;
+  char *upload_id = NULL;
+  GList *parts = NULL;
+
+  if(fstat(fd, &st) != 0) {
+    perror("fstat");
+    return -errno;
+  }
+
+  if(st.st_size < MULTIPART_MIN)
+    return -ENOTSUP;
+  if(st.st_size >= MAX_FILE_SIZE)
+    return -EFBIG;
+
+  if((upload_id = init_multipart(path, st.st_size, headers)) == NULL)
+    return -EIO;
+
+  part_size = stormfs_curl_part_size(st.st_size);
+  for(offset = 0; offset < st.st_size; offset += part_size) {
+    FILE_PART *fp = create_part(part_num++, upload_id);
+
+    fp->object = path;
+    fp->offset = offset;
+    fp->size = MIN((off_t) part_size, st.st_size - offset);
+    if(extents_overlap(dirty, fp->offset, fp->size)) {
+      fp->fd = fd;
+    } else {
+      fp->source = path;
+      fp->source_etag = etag;
+    }
+
+    parts = g_list_append(parts, fp);
+  }
+
+  if((result = put_parts(parts)) == 0)
+    result = complete_multipart(path, upload_id, headers, parts, new_etag);
+  if(result != 0)
+    abort_multipart(path, upload_id);
+
   free_parts(parts);
+  free(upload_id);
 
   return result;
 }
 
+/* objects whose upload an earlier mount left unfinished */
+GList *
+stormfs_curl_journaled(void)
+{
+  GDir *dir;
+  const gchar *name;
+  GList *paths = NULL;
+
+  if((dir = g_dir_open(curl.journal_dir, 0, NULL)) == NULL)
+    return NULL;
+
+  while((name = g_dir_read_name(dir)) != NULL) {
+    char *file;
+    struct journal *j;
+
+    if(asprintf(&file, "%s/%s", curl.journal_dir, name) == -1) {
+      fprintf(stderr, "unable to allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    if((j = journal_load(file)) != NULL) {
+      paths = g_list_append(paths, strdup(j->path));
+      journal_free(j);
+    } else {
+      unlink(file);
+    }
+
+    free(file);
+  }
+
+  g_dir_close(dir);
+
+  return paths;
+}
+
+/* whether fd still holds what the unfinished upload of path was
+   sending. An upload of anything else is aborted and forgotten. */
+bool
+stormfs_curl_journal_valid(const char *path, int fd)
+{
+  bool valid;
+  struct stat st;
+  struct journal *j;
+  char *file = journal_path(path);
+
+  if((j = journal_load(file)) == NULL) {
+    free(file);
+    return false;
+  }
+
+  valid = fd != -1 && fstat(fd, &st) == 0 &&
+    journal_matches(j, path, &st, stormfs_curl_part_size(st.st_size));
+  if(!valid)
+    journal_discard(file, j);
+
+  journal_free(j);
+  free(file);
+
+  return valid;
+}
+
+/* progress callback stopping single requests of a cancelled upload */
+static int
+cancel_cb(void *data, curl_off_t dltotal, curl_off_t dlnow,
+    curl_off_t ultotal, curl_off_t ulnow)
+{
+  return (cancel != NULL && *cancel) ? 1 : 0;
+}
+
+/* uploads made by the calling thread give up with -ECANCELED once
+   *flag is set */
+void
+stormfs_curl_cancel_on(const volatile bool *flag)
+{
+  cancel = flag;
+}
+
+/* etag, when not NULL, is set to the ETag of the uploaded object.
+   source, when not NULL, is the file fd is a snapshot of. */
 int
-stormfs_curl_upload(const char *path, GList *headers, int fd)
+stormfs_curl_upload(const char *path, GList *headers, int fd,
+    const struct stat *source, char **etag)
 {
   FILE *f;
   int result;
@@ -1955,7 +3344,7 @@ stormfs_curl_upload(const char *path, GList *headers, int fd)
     return -EFBIG;
 
   if(st.st_size >= MULTIPART_MIN)
-    return upload_multipart(path, headers, fd);
+    return upload_multipart(path, headers, fd, source, etag);
 
   if(lseek(fd, 0, SEEK_SET) == -1) {
     perror("lseek");
@@ -1975,8 +3364,23 @@ stormfs_curl_upload(const char *path, GList *headers, int fd)
   curl_easy_setopt(request->c, CURLOPT_UPLOAD, 1L);
   curl_easy_setopt(request->c, CURLOPT_INFILESIZE_LARGE, (curl_off_t) st.st_size);
   curl_easy_setopt(request->c, CURLOPT_HTTPHEADER, request->headers);
+  curl_easy_setopt(request->c, CURLOPT_HEADERDATA, (void *) &request->response);
+  curl_easy_setopt(request->c, CURLOPT_HEADERFUNCTION, write_memory_cb);
+  curl_easy_setopt(request->c, CURLOPT_XFERINFOFUNCTION, cancel_cb);
+  curl_easy_setopt(request->c, CURLOPT_NOPROGRESS, 0L);
   result = stormfs_curl_easy_perform(request->c);
 
+  if(result != 0 && cancel != NULL && *cancel)
+    result = -ECANCELED;
+
+  if(result == 0 && etag != NULL) {
+    GList *response_headers = NULL;
+
+    extract_meta(request->response.memory, &response_headers);
+    *etag = headers_to_etag(response_headers);
+    free_headers(response_headers);
+  }
+
   free_request(request);
 
   return result;
@@ -2026,6 +3430,7 @@ void
 stormfs_curl_destroy()
 {
   destroy_pool();
+  free(curl.journal_dir);
   curl_share_cleanup(curl.share);
   curl_multi_cleanup(curl.multi);
   curl_global_cleanup();
@@ -2066,6 +3471,20 @@ stormfs_curl_init(struct stormfs *stormfs)
   curl.url = stormfs->virtual_url;
   curl.bucket = stormfs->bucket;
   curl.verify_ssl = 1;
+  curl.part_size = stormfs->download_part_size;
+  curl.connections = stormfs->download_connections;
+  curl.upload_connections = stormfs->upload_connections;
+  curl.upload_part_size = stormfs->upload_part_size;
+  curl.list_shards = stormfs->list_shards;
+
+  // bucket names never start with a dot.
+  if(asprintf(&curl.journal_dir, "%s/.uploads/%s",
+      stormfs->cache_path, stormfs->bucket) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  if(g_mkdir_with_parents(curl.journal_dir, S_IRWXU) != 0)
+    perror("mkdir");
 
   stormfs_curl_set_auth(stormfs->access_key, stormfs->secret_key);
   stormfs_curl_verify_ssl(stormfs->verify_ssl);
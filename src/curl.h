@@ -16,6 +16,9 @@ typedef struct {
   char *value;
 } HTTP_HEADER;
 
+/* called with each <Contents> element of a listing, non-zero stops it */
+typedef int (*list_entry_fn)(char *contents, void *data);
+
 uid_t get_uid(const char *s);
 gid_t get_gid(const char *s);
 mode_t get_mode(const char *s);
@@ -29,6 +32,7 @@ HTTP_HEADER *acl_header(const char *acl);
 HTTP_HEADER *content_header(const char *type);
 HTTP_HEADER *copy_source_header(const char *path);
 HTTP_HEADER *copy_source_range_header(off_t first, off_t last);
+HTTP_HEADER *copy_source_if_match_header(const char *etag);
 HTTP_HEADER *copy_meta_header();
 HTTP_HEADER *ctime_header(time_t t);
 HTTP_HEADER *expires_header(const char *expires);
@@ -46,19 +50,33 @@ void free_header(HTTP_HEADER *h);
 void free_headers(GList *headers);
 GList *stat_to_headers(GList *headers, struct stat *st);
 int headers_to_stat(GList *headers, struct stat *stbuf);
+char *headers_to_etag(GList *headers);
 
 int stormfs_curl_delete(const char *path);
 void stormfs_curl_destroy();
 int stormfs_curl_get(const char *path, char **data);
-int stormfs_curl_get_file(const char *path, FILE *f);
+int stormfs_curl_get_file(const char *path, int fd);
+int stormfs_curl_get_file_range(const char *path, int fd, off_t offset, size_t size);
 int stormfs_curl_head(const char *path, GList **meta);
 int stormfs_curl_head_multi(const char *path, GList *files);
 int stormfs_curl_init(struct stormfs *stormfs);
-int stormfs_curl_list_bucket(const char *path, char **xml);
+int stormfs_curl_list_bucket(const char *path, list_entry_fn fn, void *data);
 int stormfs_curl_put(const char *path, GList *headers);
 int stormfs_curl_rename(const char *from, const char *to);
-int stormfs_curl_upload(const char *path, GList *headers, int fd);
+int stormfs_curl_upload(const char *path, GList *headers, int fd,
+    const struct stat *source, char **etag);
+int stormfs_curl_upload_update(const char *path, GList *headers, int fd,
+    const char *etag, GList *dirty, char **new_etag);
+size_t stormfs_curl_part_size(off_t size);
+GList *stormfs_curl_journaled(void);
+bool stormfs_curl_journal_valid(const char *path, int fd);
+void stormfs_curl_cancel_on(const volatile bool *flag);
 int copy_multipart(const char *from, const char *to, GList *headers, off_t size);
+struct multipart *stormfs_curl_multipart_init(const char *path, GList *headers);
+int stormfs_curl_multipart_put(struct multipart *mp, int part_num,
+    int fd, off_t offset, size_t size);
+int stormfs_curl_multipart_complete(struct multipart *mp, char **etag);
+void stormfs_curl_multipart_abort(struct multipart *mp);
 
 #endif // stormfs_curl_H
 
@@ -36,13 +36,13 @@ proxy_destroy(void)
 }
 
 int
-proxy_getattr(const char *path, struct stat *st)
+proxy_getattr(const char *path, struct stat *st, char **etag)
 {
   int result;
 
   switch(proxy.stormfs->service) {
     case AMAZON:
-      result = s3_getattr(path, st);
+      result = s3_getattr(path, st, etag);
       break;
     default:
       result = -EINVAL;
@@ -167,13 +167,13 @@ proxy_mknod(const char *path, struct stat *st)
 }
 
 int
-proxy_open(const char *path, FILE *f)
+proxy_open(const char *path, int fd)
 {
   int result;
 
   switch(proxy.stormfs->service) {
     case AMAZON:
-      result = s3_open(path, f);
+      result = s3_open(path, fd);
       break;
     default:
       result = -EINVAL;
@@ -183,13 +183,13 @@ proxy_open(const char *path, FILE *f)
 }
 
 int
-proxy_readdir(const char *path, GList **files)
+proxy_read(const char *path, int fd, off_t offset, size_t size)
 {
   int result;
 
   switch(proxy.stormfs->service) {
     case AMAZON:
-      result = s3_readdir(path, files);
+      result = s3_read(path, fd, offset, size);
       break;
     default:
       result = -EINVAL;
@@ -199,13 +199,13 @@ proxy_readdir(const char *path, GList **files)
 }
 
 int
-proxy_release(const char *path, int fd, struct stat *st)
+proxy_readdir(const char *path, readdir_fn fn, void *data)
 {
   int result;
 
   switch(proxy.stormfs->service) {
     case AMAZON:
-      result = s3_release(path, fd, st);
+      result = s3_readdir(path, fn, data);
       break;
     default:
       result = -EINVAL;
@@ -214,6 +214,104 @@ proxy_release(const char *path, int fd, struct stat *st)
   return result;
 }
 
+int
+proxy_release(const char *path, int fd, struct stat *st,
+    const struct stat *source, char **etag)
+{
+  int result;
+
+  switch(proxy.stormfs->service) {
+    case AMAZON:
+      result = s3_release(path, fd, st, source, etag);
+      break;
+    default:
+      result = -EINVAL;
+  }
+
+  return result;
+}
+
+/* upload fd over the object with the given ETag, sending only what
+   overlaps the dirty extents. new_etag is set to the ETag of the
+   updated object. */
+int
+proxy_update(const char *path, int fd, struct stat *st,
+    const char *etag, GList *dirty, char **new_etag)
+{
+  int result;
+
+  switch(proxy.stormfs->service) {
+    case AMAZON:
+      result = s3_update(path, fd, st, etag, dirty, new_etag);
+      break;
+    default:
+      result = -EINVAL;
+  }
+
+  return result;
+}
+
+struct multipart *
+proxy_upload_init(const char *path, struct stat *st)
+{
+  struct multipart *mp;
+
+  switch(proxy.stormfs->service) {
+    case AMAZON:
+      mp = s3_upload_init(path, st);
+      break;
+    default:
+      mp = NULL;
+  }
+
+  return mp;
+}
+
+int
+proxy_upload_part(struct multipart *mp, int part_num,
+    int fd, off_t offset, size_t size)
+{
+  int result;
+
+  switch(proxy.stormfs->service) {
+    case AMAZON:
+      result = s3_upload_part(mp, part_num, fd, offset, size);
+      break;
+    default:
+      result = -EINVAL;
+  }
+
+  return result;
+}
+
+int
+proxy_upload_complete(struct multipart *mp, char **etag)
+{
+  int result;
+
+  switch(proxy.stormfs->service) {
+    case AMAZON:
+      result = s3_upload_complete(mp, etag);
+      break;
+    default:
+      result = -EINVAL;
+  }
+
+  return result;
+}
+
+void
+proxy_upload_abort(struct multipart *mp)
+{
+  switch(proxy.stormfs->service) {
+    case AMAZON:
+      s3_upload_abort(mp);
+      break;
+    default:
+      break;
+  }
+}
+
 int
 proxy_rename(const char *from, const char *to, struct stat *st)
 {
@@ -10,7 +10,7 @@
 #define proxy_H
 
 void proxy_destroy(void);
-int proxy_getattr(const char *path, struct stat *st);
+int proxy_getattr(const char *path, struct stat *st, char **etag);
 int proxy_getattr_multi(const char *path, GList *files);
 int proxy_chmod(const char *path, struct stat *st);
 int proxy_chown(const char *path, struct stat *st);
@@ -18,13 +18,22 @@ int proxy_create(const char *path, struct stat *st);
 int proxy_init(struct stormfs *stormfs);
 int proxy_mkdir(const char *path, struct stat *st);
 int proxy_mknod(const char *path, struct stat *st);
-int proxy_open(const char *path, FILE *f);
-int proxy_readdir(const char *path, GList **files);
-int proxy_release(const char *path, int fd, struct stat *st);
+int proxy_open(const char *path, int fd);
+int proxy_read(const char *path, int fd, off_t offset, size_t size);
+int proxy_readdir(const char *path, readdir_fn fn, void *data);
+int proxy_release(const char *path, int fd, struct stat *st,
+    const struct stat *source, char **etag);
 int proxy_rename(const char *from, const char *to, struct stat *st);
 int proxy_rmdir(const char *path);
 int proxy_symlink(const char *from, const char *to, struct stat *st);
 int proxy_unlink(const char *path);
+int proxy_update(const char *path, int fd, struct stat *st,
+    const char *etag, GList *dirty, char **new_etag);
+struct multipart *proxy_upload_init(const char *path, struct stat *st);
+int proxy_upload_part(struct multipart *mp, int part_num,
+    int fd, off_t offset, size_t size);
+int proxy_upload_complete(struct multipart *mp, char **etag);
+void proxy_upload_abort(struct multipart *mp);
 int proxy_utimens(const char *path, struct stat *st);
 
 #endif // proxy_H
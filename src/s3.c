@@ -29,56 +29,151 @@ struct s3 {
   struct stormfs *stormfs;
 } s3;
 
-static GList *
-add_file_to_list(GList *list, const char *path, struct stat *st)
+static struct file *
+new_file(const char *path, struct stat *st, char *etag)
 {
   struct file *f = g_new0(struct file, 1);
   struct stat *stbuf = g_new0(struct stat, 1);
 
   f->path = strdup(path);
   f->name = strdup(basename(f->path));
+  f->etag = etag;
 
   if(st != NULL)
     memcpy(stbuf, st, sizeof(struct stat));
 
   f->st = stbuf;
 
-  return g_list_append(list, f);
+  return f;
 }
 
-static GList *
-xml_to_files(const char *path, char *xml)
+/* text of the first <tag> element between p and end */
+static char *
+xml_element(const char *p, const char *end, const char *tag)
 {
-  char *start_p = NULL;
-  GList *files = NULL;
+  char *start_p, *end_p;
+  char *open = g_strdup_printf("<%s>", tag);
+  char *close = g_strdup_printf("</%s>", tag);
+  char *value = NULL;
+
+  if((start_p = g_strstr_len(p, end - p, open)) != NULL) {
+    start_p += strlen(open);
+    if((end_p = g_strstr_len(start_p, end - start_p, close)) != NULL)
+      value = g_strndup(start_p, end_p - start_p);
+  }
 
-  if(strstr(xml, "xml") == NULL)
-    return files;
+  g_free(open);
+  g_free(close);
 
-  if((start_p = strstr(xml, "<Key>")) != NULL)
-    start_p += strlen("<Key>");
+  return value;
+}
 
-  while(start_p != NULL) {
-    char *name;
-    char *fullpath;
-    char *end_p = strstr(start_p, "</Key>");
+/* listings quote ETags as &quot;, HEAD responses as plain quotes */
+static char *
+xml_to_etag(const char *s)
+{
+  char *etag = g_malloc(strlen(s) + 1);
+  char *d = etag;
+
+  while(*s != '\0') {
+    if(strncmp(s, "&quot;", 6) == 0) {
+      *d++ = '"';
+      s += 6;
+    } else
+      *d++ = *s++;
+  }
+  *d = '\0';
 
-    name = g_strndup(start_p, end_p - start_p);
-    if (! name) {
-      perror("g_strndup");
-      return NULL;
-    }
+  return etag;
+}
+
+/* the size, modification time and ETag a listing carries for an entry */
+static void
+contents_to_stat(const char *p, const char *end, struct stat *st, char **etag)
+{
+  char *s;
+  GTimeVal tv;
+
+  if((s = xml_element(p, end, "Size")) != NULL) {
+    st->st_size = strtoll(s, NULL, 10);
+    g_free(s);
+  }
+
+  if((s = xml_element(p, end, "LastModified")) != NULL) {
+    if(g_time_val_from_iso8601(s, &tv))
+      st->st_mtime = tv.tv_sec;
+    g_free(s);
+  }
+
+  if((s = xml_element(p, end, "ETag")) != NULL) {
+    *etag = xml_to_etag(s);
+    g_free(s);
+  }
+}
+
+struct listing {
+  const char *path;
+  readdir_fn fn;
+  void *data;
+};
+
+static int
+contents_to_file(char *contents, void *data)
+{
+  char *name, *fullpath;
+  char *etag = NULL;
+  char *end = contents + strlen(contents);
+  struct stat st;
+  struct file *f;
+  struct listing *l = data;
+
+  if((name = xml_element(contents, end, "Key")) == NULL)
+    return 0;
+
+  memset(&st, 0, sizeof(st));
+  contents_to_stat(contents, end, &st, &etag);
+
+  fullpath = get_path(l->path, name);
+  f = new_file(fullpath, &st, etag);
+  g_free(name);
+  free(fullpath);
+
+  return l->fn(f, l->data);
+}
+
+static int
+collect_file(struct file *f, void *data)
+{
+  GList **files = data;
+  *files = g_list_prepend(*files, f);
 
-    fullpath = get_path(path, name);
-    files = add_file_to_list(files, fullpath, NULL);
-    g_free(name);
-    free(fullpath);
+  return 0;
+}
 
-    if((start_p = strstr(end_p, "<Key>")) != NULL)
-      start_p += strlen("<Key>");
+/* every entry under path, in order */
+static int
+list_files(const char *path, GList **files)
+{
+  int result;
+
+  *files = NULL;
+  if((result = s3_readdir(path, collect_file, files)) != 0) {
+    free_files(*files);
+    *files = NULL;
+    return result;
   }
 
-  return files;
+  *files = g_list_reverse(*files);
+
+  return 0;
+}
+
+static int
+contents_found(char *contents, void *data)
+{
+  *(bool *) data = true;
+
+  return 1;
 }
 
 void
@@ -88,7 +183,7 @@ s3_destroy(void)
 }
 
 int
-s3_getattr(const char *path, struct stat *st)
+s3_getattr(const char *path, struct stat *st, char **etag)
 {
   int result;
   GList *headers = NULL;
@@ -99,6 +194,9 @@ s3_getattr(const char *path, struct stat *st)
   if((result = headers_to_stat(headers, st)) != 0)
     return result;
 
+  if(etag != NULL)
+    *etag = headers_to_etag(headers);
+
   free_headers(headers);
 
   return result;
@@ -124,6 +222,11 @@ s3_getattr_multi(const char *path, GList *files)
     if(S_ISREG(stbuf->st_mode))
       stbuf->st_blocks = get_blocks(stbuf->st_size);
 
+    if(headers != NULL) {
+      free(f->etag);
+      f->etag = headers_to_etag(headers);
+    }
+
     head = next;
   }
 
@@ -210,7 +313,7 @@ s3_mkdir(const char *path, struct stat *st)
   headers = add_header(headers, content_header("application/x-directory"));
   headers = add_optional_headers(headers);
 
-  result = stormfs_curl_upload(path, headers, fd);
+  result = stormfs_curl_upload(path, headers, fd, NULL, NULL);
   free_headers(headers);
 
   if(close(fd) != 0)
@@ -236,30 +339,50 @@ s3_mknod(const char *path, struct stat *st)
 }
 
 int
-s3_open(const char *path, FILE *f)
+s3_open(const char *path, int fd)
 {
-  return stormfs_curl_get_file(path, f);
+  return stormfs_curl_get_file(path, fd);
 }
 
 int
-s3_readdir(const char *path, GList **files)
+s3_read(const char *path, int fd, off_t offset, size_t size)
 {
-  int result;
-  char *xml = NULL;
+  return stormfs_curl_get_file_range(path, fd, offset, size);
+}
 
-  if((result = stormfs_curl_list_bucket(path, &xml)) != 0) {
-    free(xml);
+int
+s3_readdir(const char *path, readdir_fn fn, void *data)
+{
+  struct listing l = { path, fn, data };
+
+  if(stormfs_curl_list_bucket(path, contents_to_file, &l) != 0)
     return -EIO;
-  }
 
-  *files = xml_to_files(path, xml);
-  free(xml);
+  return 0;
+}
+
+int
+s3_release(const char *path, int fd, struct stat *st,
+    const struct stat *source, char **etag)
+{
+  int result;
+  GList *headers = NULL;
+
+  headers = stat_to_headers(headers, st);
+  headers = add_header(headers, content_header(get_mime_type(path)));
+  headers = add_header(headers, mtime_header(time(NULL)));
+  headers = add_optional_headers(headers);
+
+  result = stormfs_curl_upload(path, headers, fd, source, etag);
+
+  free_headers(headers);
 
   return result;
 }
 
 int
-s3_release(const char *path, int fd, struct stat *st)
+s3_update(const char *path, int fd, struct stat *st,
+    const char *etag, GList *dirty, char **new_etag)
 {
   int result;
   GList *headers = NULL;
@@ -269,13 +392,51 @@ s3_release(const char *path, int fd, struct stat *st)
   headers = add_header(headers, mtime_header(time(NULL)));
   headers = add_optional_headers(headers);
 
-  result = stormfs_curl_upload(path, headers, fd);
+  result = stormfs_curl_upload_update(path, headers, fd, etag, dirty,
+      new_etag);
 
   free_headers(headers);
 
   return result;
 }
 
+struct multipart *
+s3_upload_init(const char *path, struct stat *st)
+{
+  struct multipart *mp;
+  GList *headers = NULL;
+
+  headers = stat_to_headers(headers, st);
+  headers = add_header(headers, content_header(get_mime_type(path)));
+  headers = add_header(headers, mtime_header(time(NULL)));
+  headers = add_optional_headers(headers);
+
+  mp = stormfs_curl_multipart_init(path, headers);
+
+  free_headers(headers);
+
+  return mp;
+}
+
+int
+s3_upload_part(struct multipart *mp, int part_num,
+    int fd, off_t offset, size_t size)
+{
+  return stormfs_curl_multipart_put(mp, part_num, fd, offset, size);
+}
+
+int
+s3_upload_complete(struct multipart *mp, char **etag)
+{
+  return stormfs_curl_multipart_complete(mp, etag);
+}
+
+void
+s3_upload_abort(struct multipart *mp)
+{
+  stormfs_curl_multipart_abort(mp);
+}
+
 static int
 s3_rename_file(const char *from, const char *to, struct stat *st)
 {
@@ -304,54 +465,34 @@ static int
 s3_rename_directory(const char *from, const char *to, struct stat *st)
 {
   int result;
-  char *xml = NULL, *start_p = NULL;
-
-  result = stormfs_curl_list_bucket(from, &xml);
-  if(result != 0) {
-    free(xml);
-    return -EIO;
-  }
-
-  if(strstr(xml, "xml") == NULL)
-    return -EIO;
+  GList *files = NULL, *head = NULL;
 
-  if((start_p = strstr(xml, "<Key>")) != NULL)
-    start_p += strlen("<Key>");
+  if((result = list_files(from, &files)) != 0)
+    return result;
 
-  while(start_p != NULL) {
-    char *name, *tmp, *file_from, *file_to;
-    char *end_p = strstr(start_p, "</Key>");
+  for(head = files; head != NULL; head = head->next) {
+    struct file *f = head->data;
+    char *file_from = get_path(from, f->name);
+    char *file_to   = get_path(to, f->name);
     struct stat stbuf;
 
-    tmp = g_strndup(start_p, end_p - start_p);
-    if (! tmp) {
-      return -ENOMEM;
-    }
-
-    name = basename(tmp);
-    file_from = get_path(from, name);
-    file_to   = get_path(to, name);
-
-    if((result = stormfs_getattr(file_from, &stbuf)) != 0)
-      return -result;
-
-    if(S_ISDIR(stbuf.st_mode)) {
-      if((result = s3_rename_directory(file_from, file_to, &stbuf)) != 0)
-        return result;
-    } else {
-      if((result = s3_rename_file(file_from, file_to, &stbuf)) != 0)
-        return result;
+    if((result = stormfs_getattr_meta(file_from, &stbuf)) == 0) {
+      if(S_ISDIR(stbuf.st_mode))
+        result = s3_rename_directory(file_from, file_to, &stbuf);
+      else
+        result = s3_rename_file(file_from, file_to, &stbuf);
     }
 
-    g_free(tmp);
     free(file_to);
     free(file_from);
 
-    if((start_p = strstr(end_p, "<Key>")) != NULL)
-      start_p += strlen("<Key>");
+    if(result != 0)
+      break;
   }
 
-  free(xml);
+  free_files(files);
+  if(result != 0)
+    return result;
 
   return s3_rename_file(from, to, st);
 }
@@ -373,19 +514,13 @@ int
 s3_rmdir(const char *path)
 {
   int result;
-  char *xml = NULL;
+  bool found = false;
 
-  if((result = stormfs_curl_list_bucket(path, &xml)) != 0) {
-    free(xml);
+  if((result = stormfs_curl_list_bucket(path, contents_found, &found)) != 0)
     return result;
-  }
 
-  if(strstr(xml, "ETag") != NULL)
-    result = -ENOTEMPTY;
-
-  free(xml);
-  if(result != 0)
-    return result;
+  if(found)
+    return -ENOTEMPTY;
 
   return stormfs_curl_delete(path);
 }
@@ -407,7 +542,7 @@ s3_symlink(const char *from, const char *to, struct stat *st)
   headers = add_header(headers, mode_header(st->st_mode));
   headers = add_header(headers, mtime_header(st->st_mtime));
 
-  result = stormfs_curl_upload(to, headers, fd);
+  result = stormfs_curl_upload(to, headers, fd, NULL, NULL);
 
   free_headers(headers);
   if(close(fd) != 0)
@@ -12,7 +12,7 @@
 #define s3_H
 
 void s3_destroy(void);
-int s3_getattr(const char *path, struct stat *st);
+int s3_getattr(const char *path, struct stat *st, char **etag);
 int s3_getattr_multi(const char *path, GList *files);
 int s3_chmod(const char *path, struct stat *st);
 int s3_chown(const char *path, struct stat *st);
@@ -20,13 +20,22 @@ int s3_create(const char *path, struct stat *st);
 int s3_init(struct stormfs *stormfs);
 int s3_mkdir(const char *path, struct stat *st);
 int s3_mknod(const char *path, struct stat *st);
-int s3_open(const char *path, FILE *f);
-int s3_release(const char *path, int fd, struct stat *st);
-int s3_readdir(const char *path, GList **files);
+int s3_open(const char *path, int fd);
+int s3_read(const char *path, int fd, off_t offset, size_t size);
+int s3_release(const char *path, int fd, struct stat *st,
+    const struct stat *source, char **etag);
+int s3_readdir(const char *path, readdir_fn fn, void *data);
 int s3_rename(const char *from, const char *to, struct stat *st);
 int s3_rmdir(const char *path);
 int s3_symlink(const char *from, const char *to, struct stat *st);
 int s3_unlink(const char *path);
+int s3_update(const char *path, int fd, struct stat *st,
+    const char *etag, GList *dirty, char **new_etag);
+struct multipart *s3_upload_init(const char *path, struct stat *st);
+int s3_upload_part(struct multipart *mp, int part_num,
+    int fd, off_t offset, size_t size);
+int s3_upload_complete(struct multipart *mp, char **etag);
+void s3_upload_abort(struct multipart *mp);
 int s3_utimens(const char *path, struct stat *st);
 
 #endif // s3_H
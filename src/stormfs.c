@@ -20,10 +20,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <dirent.h>
 #include <pwd.h>
 #include <grp.h>
 #include <libgen.h>
+#include <ftw.h>
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 #include <pthread.h>
@@ -35,9 +38,43 @@
 
 #define CONFIG SYSCONFDIR "/stormfs.conf"
 #define DEFAULT_CACHE_TIMEOUT 300
+#define DEFAULT_BLOCK_SIZE    4194304 /* 4MB */
+#define DEFAULT_READAHEAD_MAX 67108864 /* 64MB */
+#define MAX_READAHEAD_THREADS 32
+#define MAX_DOWNLOAD_THREADS  16
+#define MAX_UPLOAD_THREADS    16
+#define DEFAULT_WRITEBACK_MAX 1024 /* MB */
+#define WRITEBACK_RETRY_MAX   60 /* longest wait between upload attempts, seconds */
+#define SNAPSHOT_BUFFER       1048576 /* 1MB */
+#define STREAM_PART_STEP      1000 /* parts between doublings of the part size */
+#define READDIR_BATCH         100 /* entries stat'ed together */
+#define READDIR_QUEUE_MAX     1000 /* entries queued per open directory */
+#define READDIR_CACHE_MAX     10000 /* longest listing kept in the cache */
+#define DEFAULT_DOWNLOAD_PART_SIZE   8388608 /* 8MB */
+#define DEFAULT_DOWNLOAD_CONNECTIONS 8
+#define DEFAULT_UPLOAD_CONNECTIONS   8
+#define DEFAULT_UPLOAD_PART_SIZE     10485760 /* 10MB */
+#define MIN_UPLOAD_PART_SIZE         5242880 /* 5MB */
+#define DEFAULT_LIST_SHARDS          1
+#define DEFAULT_FILE_MODE            0644
 #define CACHE_CLEAN_INTERVAL  60
+#define CACHE_EVICT_INTERVAL  10
+#define CACHE_HIGH_WATERMARK  95 /* % of cache_size, start evicting */
+#define CACHE_LOW_WATERMARK   80 /* % of cache_size, stop evicting */
+#define CACHE_SAVE_INTERVAL   60
+#define BLOCKS_MAGIC "stormfs-blocks 1"
+#define META_MAGIC   "stormfs-meta 2\n"
+#define META_LISTED  1 /* entry was part of its parent's cached listing */
+#define META_LAZY    2 /* stat came from a listing, metadata not fetched */
+
+#define BLOCK_SET(map, n)   ((map)[(n) / 8] |= (1 << ((n) % 8)))
+#define BLOCK_CLEAR(map, n) ((map)[(n) / 8] &= ~(1 << ((n) % 8)))
+#define BLOCK_ISSET(map, n) ((map)[(n) / 8] & (1 << ((n) % 8)))
 
 #define STORMFS_OPT(t, p, v) { t, offsetof(struct stormfs, p), v }
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 #define DEBUG(format, ...) \
         do { if (stormfs.debug) fprintf(stderr, format, __VA_ARGS__); } while(0)
 
@@ -45,13 +82,166 @@ struct stormfs stormfs;
 
 struct cache {
   bool on;
+  bool lazy;
   char *path;
+  char *blocks_path;
   int timeout;
+  size_t block_size;
   time_t last_cleaned;
   GHashTable *files;
   pthread_mutex_t lock;
 } cache;
 
+struct meta {
+  char *path;           /* snapshot of cache.files under cache_path */
+  bool stop;
+  pthread_t saver;
+  pthread_cond_t cond;
+  pthread_mutex_t lock;
+} meta;
+
+/* a cache.files entry as stored in the metadata snapshot, followed by
+   path_len bytes of path and etag_len bytes of ETag */
+struct meta_record {
+  uint32_t path_len;
+  uint32_t etag_len;
+  uint32_t flags;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t rdev;
+  int64_t size;
+  int64_t mtime;
+  int64_t ctime;
+  int64_t valid;        /* when the entry expires */
+};
+
+struct lru {
+  off_t high;           /* bytes used before eviction starts */
+  off_t low;            /* bytes used once eviction stops */
+  bool stop;
+  GQueue *order;        /* cached files, least recently used first */
+  GHashTable *index;    /* path -> link in order */
+  unsigned long seq;    /* bumped on every touch */
+  pthread_t evictor;
+  pthread_cond_t cond;
+  pthread_mutex_t lock;
+} lru;
+
+struct lru_entry {
+  char *path;           /* file path, relative to cache.path */
+  off_t size;           /* bytes used on disk */
+  time_t atime;         /* last access, only used to order the index */
+  unsigned long seq;    /* lru.seq when last touched */
+};
+
+/* an indexed file as lru_evict saw it before measuring it */
+struct lru_candidate {
+  char *path;
+  unsigned long seq;
+  off_t size;           /* bytes used on disk, -1 once gone */
+};
+
+struct readahead {
+  size_t max;           /* bytes allowed in flight per mount */
+  size_t inflight;      /* bytes currently in flight */
+  GThreadPool *pool;
+  pthread_mutex_t lock;
+} ra;
+
+struct download {
+  bool stop;            /* set on unmount, abandons whole-file downloads */
+  size_t max;           /* most blocks fetched by a single request */
+  GThreadPool *pool;
+} dl;
+
+struct writeback {
+  bool on;
+  bool stop;            /* set on unmount, failed uploads aren't retried */
+  size_t max;           /* bytes allowed queued for upload */
+  size_t dirty;         /* bytes queued or being uploaded */
+  size_t queued;        /* uploads queued or running */
+  char *snapshot_path;  /* where snapshots of released files are taken */
+  GThreadPool *pool;
+  pthread_t resumer;    /* resumes uploads left by an earlier mount */
+  pthread_cond_t cond;  /* signalled when uploads finish */
+  pthread_mutex_t lock;
+} wb;
+
+struct streaming {
+  bool on;
+  GThreadPool *pool;
+} su;
+
+struct stream {
+  struct multipart *mp; /* started once the first part is written */
+  struct stat st;       /* attributes the upload was started with */
+  unsigned long gen;    /* generation of the cache file being written */
+  off_t next;           /* end of the data written so far */
+  off_t sent;           /* data handed to the uploader */
+  int part_num;         /* last part handed to the uploader */
+  int inflight;         /* parts being uploaded */
+  int err;              /* first part that failed */
+  bool broken;          /* written behind what was sent */
+  bool starting;        /* the upload is being started by a part */
+  pthread_cond_t cond;  /* signalled when parts finish or start the upload */
+  pthread_mutex_t lock;
+};
+
+struct stream_part {
+  struct handle *h;     /* handle being written, waits for its parts */
+  int num;              /* part number */
+  off_t offset;         /* offset of the part in the cache file */
+  size_t size;          /* size of the part */
+};
+
+struct handle {
+  int fd;               /* cache file descriptor */
+  int ufd;              /* what uploads read, fd or a snapshot of it */
+  struct stat snap;     /* cache file as it was when snapshotted */
+  bool sparse;          /* the snapshot only holds the parts an update sends */
+  volatile bool superseded; /* a newer version was queued for upload */
+  int flags;            /* open(2) flags */
+  struct file *f;       /* cache entry, referenced while open */
+  size_t block;         /* block touched by the last read */
+  size_t window;        /* readahead window in blocks */
+  size_t ahead;         /* first block not yet read ahead */
+  size_t dirty;         /* bytes reserved for write-back */
+  bool modified;        /* written through this handle */
+  unsigned long gen;    /* generation of the cache file when opened */
+  char *etag;           /* ETag of the object when opened */
+  off_t size;           /* size of the object when opened */
+  guchar *written;      /* blocks to send, the file's dirty map when taken */
+  size_t nwritten;      /* number of blocks the written map covers */
+  unsigned long writes; /* writes to the file when the map was taken */
+  struct stream *stream; /* parts uploaded while writing */
+};
+
+struct fetch {
+  struct file *f;       /* cache entry, referenced until the fetch lands */
+  int fd;               /* duplicate of the reader's cache fd */
+  size_t block;         /* block being fetched */
+};
+
+/* an open directory, listed by a background thread into a bounded queue
+   readdir hands entries to filler from */
+struct dir_handle {
+  char *path;           /* directory path */
+  GList *batch;         /* listed entries waiting to be stat'ed */
+  size_t nbatch;        /* number of entries in batch */
+  GQueue entries;       /* entries not yet handed to filler */
+  off_t pos;            /* offset of the first queued entry */
+  GList *listing;       /* cache entries kept for the directory's listing */
+  size_t nlisted;       /* number of entries listed */
+  bool started;         /* the lister thread is running */
+  bool done;            /* everything listed is queued */
+  volatile bool stop;   /* the directory was closed or rewound */
+  int err;              /* error the listing ended with */
+  pthread_t lister;
+  pthread_cond_t cond;  /* signalled when entries are queued or taken */
+  pthread_mutex_t lock;
+};
+
 enum {
   KEY_HELP,
   KEY_VERSION,
@@ -72,6 +262,22 @@ static struct fuse_opt stormfs_opts[] = {
   STORMFS_OPT("mime_path=%s",     mime_path,     0),
   STORMFS_OPT("cache_path=%s",    cache_path,    0),
   STORMFS_OPT("cache_timeout=%u", cache_timeout, 0),
+  STORMFS_OPT("cache_size=%u",    cache_size,    0),
+  STORMFS_OPT("lazy_read",        lazy_read,     1),
+  STORMFS_OPT("block_size=%u",    block_size,    0),
+  STORMFS_OPT("readahead_max=%u", readahead_max, 0),
+  STORMFS_OPT("download_part_size=%u",   download_part_size,   0),
+  STORMFS_OPT("download_connections=%u", download_connections, 0),
+  STORMFS_OPT("upload_connections=%u",   upload_connections,   0),
+  STORMFS_OPT("upload_part_size=%u",     upload_part_size,     0),
+  STORMFS_OPT("list_shards=%u",          list_shards,          0),
+  STORMFS_OPT("writeback",               writeback,            1),
+  STORMFS_OPT("writeback_max=%u",        writeback_max,        0),
+  STORMFS_OPT("stream_upload",           stream_upload,        1),
+  STORMFS_OPT("fast_readdir",            fast_readdir,         1),
+  STORMFS_OPT("default_uid=%u",          default_uid,          0),
+  STORMFS_OPT("default_gid=%u",          default_gid,          0),
+  STORMFS_OPT("default_mode=%o",         default_mode,         0),
 
   FUSE_OPT_KEY("-d",            KEY_FOREGROUND),
   FUSE_OPT_KEY("--debug",       KEY_FOREGROUND),
@@ -202,6 +408,343 @@ cache_path(struct file *f)
   return fullpath;
 }
 
+static char *
+cache_blocks_path(struct file *f)
+{
+  char *path;
+
+  if(asprintf(&path, "%s%s", cache.blocks_path, f->path) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return path;
+}
+
+static void
+cache_blocks_unlink(struct file *f)
+{
+  char *bp = cache_blocks_path(f);
+
+  unlink(bp);
+  free(bp);
+}
+
+static void
+lru_entry_free(struct lru_entry *e)
+{
+  free(e->path);
+  g_free(e);
+}
+
+/* move path to the most recently used end of the index */
+static void
+lru_touch(const char *path)
+{
+  GList *link;
+  struct lru_entry *e;
+
+  if(lru.order == NULL)
+    return;
+
+  pthread_mutex_lock(&lru.lock);
+  if((link = g_hash_table_lookup(lru.index, path)) != NULL) {
+    g_queue_unlink(lru.order, link);
+    g_queue_push_tail_link(lru.order, link);
+    ((struct lru_entry *) link->data)->seq = ++lru.seq;
+  } else {
+    e = g_new0(struct lru_entry, 1);
+    e->path = strdup(path);
+    e->seq = ++lru.seq;
+    g_queue_push_tail(lru.order, e);
+    g_hash_table_insert(lru.index, e->path, g_queue_peek_tail_link(lru.order));
+
+    /* a new file, usage is about to grow */
+    pthread_cond_signal(&lru.cond);
+  }
+  pthread_mutex_unlock(&lru.lock);
+}
+
+static void
+cache_blocks_free(struct file *f)
+{
+  g_free(f->blocks);
+  g_free(f->fetching);
+  f->blocks = NULL;
+  f->fetching = NULL;
+  f->nblocks = 0;
+  f->missing = 0;
+}
+
+static bool
+cache_blocks_fetching(struct file *f)
+{
+  size_t i;
+
+  if(f->fetching == NULL)
+    return false;
+
+  for(i = 0; i < f->nblocks / 8 + 1; i++)
+    if(f->fetching[i] != 0)
+      return true;
+
+  return false;
+}
+
+static void
+cache_blocks_init(struct file *f, off_t size)
+{
+  size_t len;
+
+  cache_blocks_free(f);
+
+  f->size = size;
+  f->nblocks = (size + cache.block_size - 1) / cache.block_size;
+  f->missing = f->nblocks;
+  if(f->nblocks == 0)
+    return;
+
+  len = f->nblocks / 8 + 1;
+  f->blocks = g_malloc0(len);
+  f->fetching = g_malloc0(len);
+}
+
+static void
+cache_blocks_truncate(struct file *f, off_t size)
+{
+  size_t i, nblocks;
+
+  if(f->blocks == NULL || size >= f->size)
+    return;
+
+  /* anything past the new size will never be fetched */
+  f->size = size;
+  nblocks = (size + cache.block_size - 1) / cache.block_size;
+
+  f->missing = 0;
+  for(i = 0; i < nblocks; i++)
+    if(!BLOCK_ISSET(f->blocks, i))
+      f->missing++;
+
+  f->nblocks = nblocks;
+  if(f->missing == 0)
+    cache_blocks_free(f);
+}
+
+/* blocks past the end of the fetched object were written locally */
+static void
+cache_blocks_grow(struct file *f, off_t size)
+{
+  size_t i, nblocks, len, old_len;
+
+  if(f->blocks == NULL || size <= f->size)
+    return;
+
+  nblocks = (size + cache.block_size - 1) / cache.block_size;
+  len = nblocks / 8 + 1;
+  old_len = f->nblocks / 8 + 1;
+  f->blocks = g_realloc(f->blocks, len);
+  f->fetching = g_realloc(f->fetching, len);
+  memset(f->blocks + old_len, 0, len - old_len);
+  memset(f->fetching + old_len, 0, len - old_len);
+
+  for(i = f->nblocks; i < nblocks; i++)
+    BLOCK_SET(f->blocks, i);
+
+  f->size = size;
+  f->nblocks = nblocks;
+}
+
+/* partially fetched cache files are only meaningful alongside
+   their block map, drop them once the map goes away. */
+static void
+cache_unlink_partial(struct file *f)
+{
+  struct stat st;
+  char *cp = cache_path(f);
+
+  if(stat(cp, &st) == 0 && st.st_ino == f->ino) {
+    unlink(cp);
+    cache_blocks_unlink(f);
+  }
+
+  free(cp);
+}
+
+/* write the block map of a cache file, and the ETag its blocks came
+   from, to a sidecar under cache.blocks_path so the blocks outlive the
+   cache entry and the mount. Whole files get a full map once, when
+   they complete. The map may lag behind the cache file but never
+   claims a block that isn't synced. */
+static int
+cache_blocks_save(struct file *f)
+{
+  int fd, tfd;
+  FILE *fp;
+  ino_t ino;
+  off_t size;
+  size_t len;
+  unsigned long gen;
+  guchar *blocks;
+  char *etag, *cp, *bp, *tmp;
+  int result = -1;
+
+  pthread_mutex_lock(&f->lock);
+  if(f->blocks != NULL) {
+    len = f->nblocks / 8 + 1;
+    blocks = g_memdup(f->blocks, len);
+  } else if(f->completed) {
+    len = (f->size + cache.block_size - 1) / cache.block_size / 8 + 1;
+    blocks = g_malloc(len);
+    memset(blocks, 0xff, len);
+    f->completed = false;
+  } else {
+    pthread_mutex_unlock(&f->lock);
+    return 0;
+  }
+
+  ino = f->ino;
+  gen = f->gen;
+  size = f->size;
+  etag = strdup(f->blocks_etag != NULL ? f->blocks_etag : "");
+  pthread_mutex_unlock(&f->lock);
+
+  cp = cache_path(f);
+  fd = open(cp, O_RDONLY);
+  free(cp);
+  if(fd == -1) {
+    g_free(blocks);
+    free(etag);
+    return -1;
+  }
+
+  if(fdatasync(fd) != 0) {
+    perror("fdatasync");
+    goto out;
+  }
+
+  bp = cache_blocks_path(f);
+  if(asprintf(&tmp, "%s.XXXXXX", bp) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(cache_mkpath(bp) != 0 || (tfd = mkstemp(tmp)) == -1) {
+    free(tmp);
+    free(bp);
+    goto out;
+  }
+
+  if((fp = fdopen(tfd, "w")) == NULL) {
+    close(tfd);
+    unlink(tmp);
+    free(tmp);
+    free(bp);
+    goto out;
+  }
+
+  fprintf(fp, "%s\netag %s\nsize %jd\nblock_size %zu\nino %ju\n\n",
+      BLOCKS_MAGIC, etag, (intmax_t) size, cache.block_size, (uintmax_t) ino);
+  fwrite(blocks, 1, len, fp);
+  if(fflush(fp) == 0 && fsync(fileno(fp)) == 0 && !ferror(fp))
+    result = 0;
+  fclose(fp);
+
+  /* the cache file may have been replaced meanwhile */
+  pthread_mutex_lock(&f->lock);
+  if(result == 0 && f->gen == gen)
+    result = rename(tmp, bp);
+  else
+    result = unlink(tmp);
+  pthread_mutex_unlock(&f->lock);
+
+  free(tmp);
+  free(bp);
+
+out:
+  close(fd);
+  g_free(blocks);
+  free(etag);
+
+  return result;
+}
+
+/* load the sidecar block map for the cache file described by st.
+   Returns 1 if it matches the remote object, 0 if there is none and
+   -1 if the cache file can't be trusted. Must be called with f->lock
+   held. */
+static int
+cache_blocks_load(struct file *f, struct stat *st)
+{
+  FILE *fp;
+  size_t i, len;
+  char line[1024];
+  char *bp, *etag = NULL;
+  intmax_t size = -1;
+  size_t block_size = 0;
+  uintmax_t ino = 0;
+  int result = -1;
+
+  bp = cache_blocks_path(f);
+  fp = fopen(bp, "r");
+  free(bp);
+  if(fp == NULL)
+    return (errno == ENOENT) ? 0 : -1;
+
+  if(fgets(line, sizeof(line), fp) == NULL ||
+      strcmp(line, BLOCKS_MAGIC "\n") != 0)
+    goto out;
+
+  while(fgets(line, sizeof(line), fp) != NULL && strcmp(line, "\n") != 0) {
+    line[strcspn(line, "\n")] = '\0';
+
+    if(strncmp(line, "etag ", 5) == 0 && etag == NULL)
+      etag = strdup(line + 5);
+    else if(sscanf(line, "size %jd", &size) == 1)
+      continue;
+    else if(sscanf(line, "block_size %zu", &block_size) == 1)
+      continue;
+    else if(sscanf(line, "ino %ju", &ino) == 1)
+      continue;
+  }
+
+  if(etag == NULL || *etag == '\0' || f->etag == NULL ||
+      strcmp(etag, f->etag) != 0)
+    goto out;
+  if(size != f->st->st_size || size != st->st_size)
+    goto out;
+  if(block_size != cache.block_size || ino != st->st_ino)
+    goto out;
+
+  cache_blocks_init(f, size);
+  if(f->nblocks > 0) {
+    len = f->nblocks / 8 + 1;
+    if(fread(f->blocks, 1, len, fp) != len) {
+      cache_blocks_free(f);
+      goto out;
+    }
+
+    for(i = 0; i < f->nblocks; i++)
+      if(BLOCK_ISSET(f->blocks, i))
+        f->missing--;
+  }
+
+  f->ino = st->st_ino;
+  free(f->blocks_etag);
+  f->blocks_etag = etag;
+  etag = NULL;
+  if(f->missing == 0)
+    cache_blocks_free(f);
+
+  result = 1;
+
+out:
+  free(etag);
+  fclose(fp);
+
+  return result;
+}
+
 static int
 cache_create_file(struct file *f)
 {
@@ -214,9 +757,23 @@ cache_create_file(struct file *f)
 
   unlink(cp);
 
+  /* let fetches into the previous cache file settle */
+  pthread_mutex_lock(&f->lock);
+  while(cache_blocks_fetching(f))
+    pthread_cond_wait(&f->cond, &f->lock);
+  cache_blocks_free(f);
+  cache_blocks_unlink(f);
+  free(f->blocks_etag);
+  f->blocks_etag = NULL;
+  f->completed = false;
+  f->gen++;
+  pthread_mutex_unlock(&f->lock);
+
   result = open(cp, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
   if(result == -1)
     perror("open");
+  else
+    lru_touch(f->path);
 
   free(cp);
 
@@ -238,6 +795,8 @@ cache_mknod(struct file *f, mode_t mode, dev_t rdev)
   result = mknod(cp, mode, rdev);
   if(result == -1)
     perror("mknod");
+  else
+    lru_touch(f->path);
 
   free(cp);
 
@@ -247,11 +806,20 @@ cache_mknod(struct file *f, mode_t mode, dev_t rdev)
 void
 free_file(struct file *f)
 {
+  /* with the cache on, partial files stay behind their sidecar */
+  if(f->blocks != NULL && !cache.on)
+    cache_unlink_partial(f);
+
   free(f->name);
   free(f->path);
+  free(f->etag);
+  free(f->blocks_etag);
+  g_free(f->dirty);
   if(f->st != NULL) free(f->st);
   if(f->dir != NULL) g_list_free(f->dir);
   free_headers(f->headers);
+  cache_blocks_free(f);
+  pthread_cond_destroy(&f->cond);
   pthread_mutex_destroy(&f->lock);
   free(f);
 }
@@ -263,15 +831,25 @@ free_files(GList *files)
   g_list_free(files);
 }
 
+/* must be called with cache.lock held */
+static void
+cache_unref(struct file *f)
+{
+  if(--f->refs == 0)
+    free_file(f);
+}
+
 static int
 cache_init(void)
 {
   cache.on = (stormfs.cache) ? true : false;
+  cache.lazy = (stormfs.lazy_read) ? true : false;
   cache.timeout = stormfs.cache_timeout;
+  cache.block_size = stormfs.block_size;
   cache.last_cleaned = time(NULL);
   pthread_mutex_init(&cache.lock, NULL);
   cache.files = g_hash_table_new_full(g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) free_file);
+      g_free, (GDestroyNotify) cache_unref);
 
   validate_cache_path(stormfs.cache_path);
   if(asprintf(&cache.path, "%s/%s",
@@ -280,14 +858,22 @@ cache_init(void)
     exit(EXIT_FAILURE);
   }
 
+  // bucket names never start with a dot.
+  if(asprintf(&cache.blocks_path, "%s/.blocks/%s",
+      stormfs.cache_path, stormfs.bucket) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
   return 0;
 }
 
 static int
 cache_destroy(void)
 {
-  free(cache.path);
   g_hash_table_destroy(cache.files);
+  free(cache.path);
+  free(cache.blocks_path);
   pthread_mutex_destroy(&cache.lock);
 
   return 0;
@@ -333,6 +919,11 @@ static int
 cache_clean_file(void *key_, struct file *f, time_t *now)
 {
   (void) key_;
+
+  /* entries backing open files are never expired */
+  if(f->refs > 1)
+    return FALSE;
+
   if(*now > f->valid)
     return TRUE;
 
@@ -361,7 +952,9 @@ cache_insert(const char *path)
   f->name = strdup(basename(f->path));
   f->headers = NULL;
   f->st = NULL;
+  f->refs = 1;
   pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
   cache_touch(f);
 
   g_hash_table_insert(cache.files, strdup(path), f);
@@ -384,75 +977,2057 @@ cache_get(const char *path)
   return f;
 }
 
-static bool
-cache_valid(struct file *f)
+/* like cache_get, but holds a reference on the entry until
+   cache_release is called. */
+static struct file *
+cache_acquire(const char *path)
 {
-  if(!cache.on)
-    return false;
+  struct file *f = NULL;
 
-  if(f->valid - time(NULL) >= 0)
-    return true;
+  pthread_mutex_lock(&cache.lock);
+  cache_clean();
+  f = g_hash_table_lookup(cache.files, path);
+  if(f == NULL)
+    f = cache_insert(path);
+  f->refs++;
+  pthread_mutex_unlock(&cache.lock);
 
-  return false;
+  return f;
 }
 
-static bool
-cache_file_exists(struct file *f)
+static void
+cache_ref(struct file *f)
 {
-  int result;
-  struct stat st;
-  char *cp = cache_path(f);
-
-  result = stat(cp, &st);
-  free(cp);
-
-  return (result == 0) ? true : false;
+  pthread_mutex_lock(&cache.lock);
+  f->refs++;
+  pthread_mutex_unlock(&cache.lock);
 }
 
-static bool
-cache_file_valid(struct file *f)
+static void
+cache_release(struct file *f)
 {
-  char *cp;
-  int result;
-  struct stat st;
+  pthread_mutex_lock(&cache.lock);
+  cache_unref(f);
+  pthread_mutex_unlock(&cache.lock);
+}
 
-  if(!cache_valid(f))
-    return false;
+struct meta_snapshot {
+  FILE *fp;
+  size_t count;
+  GHashTable *written;  /* entry -> offset of its record + 1 */
+  GArray *listed;       /* offsets of records to flag META_LISTED */
+};
 
-  if(!cache_file_exists(f))
-    return false;
+/* a listing is only saved when every entry in it was, otherwise it
+   would come back with entries missing */
+static void
+meta_mark_listed(void *key, struct file *dir, struct meta_snapshot *snap)
+{
+  GList *head;
+  guint len = snap->listed->len;
 
-  cp = cache_path(f);
-  result = stat(cp, &st);
-  free(cp);
+  if(pthread_mutex_trylock(&dir->lock) != 0)
+    return;
 
-  if(result != 0)
-    return false;
+  for(head = g_list_first(dir->dir); head != NULL; head = head->next) {
+    size_t offset = GPOINTER_TO_SIZE(g_hash_table_lookup(snap->written,
+          head->data));
 
-  if(f->st->st_mtime > st.st_mtime)
-    return false;
+    if(offset == 0) {
+      g_array_set_size(snap->listed, len);
+      break;
+    }
+    offset--;
+    g_array_append_val(snap->listed, offset);
+  }
 
-  return true;
+  pthread_mutex_unlock(&dir->lock);
 }
 
-static int
-validate_mountpoint(const char *path, struct stat *stbuf)
+static void
+meta_write_record(void *key, struct file *f, struct meta_snapshot *snap)
 {
-  DIR *d;
+  struct meta_record r;
 
-  DEBUG("validating mountpoint: %s\n", path);
+  /* entries being updated are picked up by the next snapshot, waiting
+     on them here would invert the dir->lock, cache.lock order */
+  if(pthread_mutex_trylock(&f->lock) != 0)
+    return;
 
-  if(stat(path, stbuf) == -1) {
-    fprintf(stderr, "%s: unable to stat MOUNTPOINT %s: %s\n",
-        stormfs.progname, path, strerror(errno));
-    return -1;
+  if(f->st == NULL) {
+    pthread_mutex_unlock(&f->lock);
+    return;
   }
 
-  if((d = opendir(path)) == NULL) {
-    fprintf(stderr, "%s: unable to open MOUNTPOINT %s: %s\n",
-        stormfs.progname, path, strerror(errno));
-    return -1;
-  }
+  memset(&r, 0, sizeof(r));
+  r.path_len = strlen(f->path);
+  r.etag_len = (f->etag != NULL) ? strlen(f->etag) : 0;
+  r.flags = (f->lazy_meta) ? META_LAZY : 0;
+  r.mode = f->st->st_mode;
+  r.uid = f->st->st_uid;
+  r.gid = f->st->st_gid;
+  r.rdev = f->st->st_rdev;
+  r.size = f->st->st_size;
+  r.mtime = f->st->st_mtime;
+  r.ctime = f->st->st_ctime;
+  r.valid = f->valid;
+
+  g_hash_table_insert(snap->written, f,
+      GSIZE_TO_POINTER((size_t) ftell(snap->fp) + 1));
+  fwrite(&r, sizeof(r), 1, snap->fp);
+  fwrite(f->path, 1, r.path_len, snap->fp);
+  if(r.etag_len > 0)
+    fwrite(f->etag, 1, r.etag_len, snap->fp);
+  snap->count++;
+  pthread_mutex_unlock(&f->lock);
+}
+
+/* write the stat data and ETags in cache.files to meta.path. The
+   snapshot is built in memory under cache.lock, and written out
+   after it is dropped. */
+static int
+meta_save(void)
+{
+  int fd;
+  char *buf, *tmp;
+  size_t len;
+  uint64_t count;
+  guint i;
+  struct meta_snapshot snap;
+  int result = -1;
+
+  if((snap.fp = open_memstream(&buf, &len)) == NULL)
+    return -1;
+
+  count = 0;
+  snap.count = 0;
+  snap.written = g_hash_table_new(g_direct_hash, g_direct_equal);
+  snap.listed = g_array_new(FALSE, FALSE, sizeof(size_t));
+  fwrite(META_MAGIC, 1, strlen(META_MAGIC), snap.fp);
+  fwrite(&count, sizeof(count), 1, snap.fp);
+
+  pthread_mutex_lock(&cache.lock);
+  g_hash_table_foreach(cache.files, (GHFunc) meta_write_record, &snap);
+  g_hash_table_foreach(cache.files, (GHFunc) meta_mark_listed, &snap);
+  pthread_mutex_unlock(&cache.lock);
+
+  fclose(snap.fp);
+
+  count = snap.count;
+  memcpy(buf + strlen(META_MAGIC), &count, sizeof(count));
+
+  /* records are unaligned in buf */
+  for(i = 0; i < snap.listed->len; i++) {
+    uint32_t flags;
+    char *p = buf + g_array_index(snap.listed, size_t, i) +
+      offsetof(struct meta_record, flags);
+
+    memcpy(&flags, p, sizeof(flags));
+    flags |= META_LISTED;
+    memcpy(p, &flags, sizeof(flags));
+  }
+
+  g_hash_table_destroy(snap.written);
+  g_array_free(snap.listed, TRUE);
+
+  if(asprintf(&tmp, "%s.XXXXXX", meta.path) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(cache_mkpath(meta.path) == 0 && (fd = mkstemp(tmp)) != -1) {
+    if(write(fd, buf, len) == (ssize_t) len && fsync(fd) == 0)
+      result = 0;
+    close(fd);
+
+    if(result == 0)
+      result = rename(tmp, meta.path);
+    if(result != 0)
+      unlink(tmp);
+  }
+
+  DEBUG("cache: saved %zu entries\n", snap.count);
+
+  free(tmp);
+  free(buf);
+
+  return result;
+}
+
+static gint
+meta_cmp_name(struct file *a, struct file *b)
+{
+  return strcmp(a->name, b->name);
+}
+
+/* restore the entries saved by meta_save. They are served like any
+   other entry until the cache_timeout they were saved with expires,
+   counting the time the filesystem was unmounted. */
+static int
+meta_load(void)
+{
+  int fd;
+  char *map, *p, *end;
+  uint64_t i, count;
+  struct stat st;
+  time_t now = time(NULL);
+  GList *dirs = NULL, *head;
+
+  if((fd = open(meta.path, O_RDONLY)) == -1)
+    return (errno == ENOENT) ? 0 : -1;
+
+  if(fstat(fd, &st) != 0 ||
+      st.st_size < (off_t) (strlen(META_MAGIC) + sizeof(count))) {
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return -1;
+
+  if(memcmp(map, META_MAGIC, strlen(META_MAGIC)) != 0) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  p = map + strlen(META_MAGIC);
+  end = map + st.st_size;
+  memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+
+  pthread_mutex_lock(&cache.lock);
+  for(i = 0; i < count; i++) {
+    struct file *f;
+    struct meta_record r;
+    char *path;
+
+    if(end - p < (ptrdiff_t) sizeof(r))
+      break;
+    memcpy(&r, p, sizeof(r));
+    p += sizeof(r);
+
+    if((size_t) (end - p) < (size_t) r.path_len + r.etag_len || r.path_len == 0)
+      break;
+
+    path = g_strndup(p, r.path_len);
+    p += r.path_len;
+
+    if((f = g_hash_table_lookup(cache.files, path)) == NULL)
+      f = cache_insert(path);
+    g_free(path);
+
+    if(f->st == NULL)
+      f->st = g_new0(struct stat, 1);
+    f->st->st_mode = r.mode;
+    f->st->st_uid = r.uid;
+    f->st->st_gid = r.gid;
+    f->st->st_rdev = r.rdev;
+    f->st->st_size = r.size;
+    f->st->st_mtime = r.mtime;
+    f->st->st_ctime = r.ctime;
+    f->st->st_nlink = 1;
+    if(S_ISREG(f->st->st_mode))
+      f->st->st_blocks = get_blocks(f->st->st_size);
+
+    free(f->etag);
+    f->etag = (r.etag_len > 0) ? g_strndup(p, r.etag_len) : NULL;
+    f->lazy_meta = (r.flags & META_LAZY) ? true : false;
+    f->valid = MIN((time_t) r.valid, now + cache.timeout);
+    p += r.etag_len;
+
+    /* put the entry back into its parent's listing */
+    if(r.flags & META_LISTED) {
+      struct file *dir;
+      char *parent = g_path_get_dirname(f->path);
+
+      if((dir = g_hash_table_lookup(cache.files, parent)) == NULL)
+        dir = cache_insert(parent);
+      g_free(parent);
+
+      if(dir->dir == NULL)
+        dirs = g_list_prepend(dirs, dir);
+      dir->dir = g_list_prepend(dir->dir, f);
+    }
+  }
+
+  for(head = dirs; head != NULL; head = head->next) {
+    struct file *dir = head->data;
+    dir->dir = g_list_sort(dir->dir, (GCompareFunc) meta_cmp_name);
+  }
+  pthread_mutex_unlock(&cache.lock);
+
+  DEBUG("cache: restored %ju entries\n", (uintmax_t) i);
+
+  g_list_free(dirs);
+  munmap(map, st.st_size);
+
+  return 0;
+}
+
+static void *
+meta_saver(void *data)
+{
+  struct timespec ts;
+
+  pthread_mutex_lock(&meta.lock);
+  while(!meta.stop) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += CACHE_SAVE_INTERVAL;
+    pthread_cond_timedwait(&meta.cond, &meta.lock, &ts);
+    if(meta.stop)
+      break;
+
+    pthread_mutex_unlock(&meta.lock);
+    if(meta_save() != 0)
+      DEBUG("unable to save %s\n", meta.path);
+    pthread_mutex_lock(&meta.lock);
+  }
+  pthread_mutex_unlock(&meta.lock);
+
+  return NULL;
+}
+
+static int
+meta_init(void)
+{
+  meta.path = NULL;
+  if(!cache.on)
+    return 0;
+
+  if(asprintf(&meta.path, "%s/.meta/%s",
+      stormfs.cache_path, stormfs.bucket) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(meta_load() != 0)
+    DEBUG("ignoring unreadable %s\n", meta.path);
+
+  meta.stop = false;
+  pthread_cond_init(&meta.cond, NULL);
+  pthread_mutex_init(&meta.lock, NULL);
+  if(pthread_create(&meta.saver, NULL, meta_saver, NULL) != 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+meta_destroy(void)
+{
+  if(meta.path == NULL)
+    return 0;
+
+  pthread_mutex_lock(&meta.lock);
+  meta.stop = true;
+  pthread_cond_signal(&meta.cond);
+  pthread_mutex_unlock(&meta.lock);
+  pthread_join(meta.saver, NULL);
+
+  if(meta_save() != 0)
+    DEBUG("unable to save %s\n", meta.path);
+
+  pthread_cond_destroy(&meta.cond);
+  pthread_mutex_destroy(&meta.lock);
+  free(meta.path);
+  meta.path = NULL;
+
+  return 0;
+}
+
+static bool
+cache_valid(struct file *f)
+{
+  if(!cache.on)
+    return false;
+
+  if(f->valid - time(NULL) >= 0)
+    return true;
+
+  return false;
+}
+
+static bool
+cache_file_exists(struct file *f)
+{
+  int result;
+  struct stat st;
+  char *cp = cache_path(f);
+
+  result = stat(cp, &st);
+  free(cp);
+
+  return (result == 0) ? true : false;
+}
+
+static bool
+cache_file_valid(struct file *f)
+{
+  char *cp;
+  int result;
+  struct stat st;
+
+  if(!cache_valid(f))
+    return false;
+
+  if(!cache_file_exists(f))
+    return false;
+
+  cp = cache_path(f);
+  result = stat(cp, &st);
+  free(cp);
+
+  if(result != 0)
+    return false;
+
+  /* files fetched from the object are valid as long as the blocks
+     they hold came from its current version, whatever its mtime */
+  pthread_mutex_lock(&f->lock);
+  if(f->blocks == NULL && f->blocks_etag == NULL)
+    result = cache_blocks_load(f, &st);
+  else if(st.st_ino == f->ino && f->etag != NULL &&
+      g_strcmp0(f->etag, f->blocks_etag) == 0)
+    result = 1;
+  else
+    result = -1;
+  pthread_mutex_unlock(&f->lock);
+
+  if(result != 0)
+    return (result > 0) ? true : false;
+
+  if(f->st->st_mtime > st.st_mtime)
+    return false;
+
+  return true;
+}
+
+static int
+cache_open_file(struct file *f)
+{
+  int fd;
+  char *cp = cache_path(f);
+
+  fd = open(cp, O_RDWR);
+  free(cp);
+
+  if(fd != -1)
+    lru_touch(f->path);
+
+  return fd;
+}
+
+/* create an empty, sparse cache file whose blocks are fetched
+   on demand by cache_fetch. */
+static int
+cache_create_sparse(struct file *f, off_t size)
+{
+  int fd;
+  struct stat st;
+
+  if((fd = cache_create_file(f)) < 0)
+    return -1;
+
+  if(ftruncate(fd, size) != 0 || fstat(fd, &st) != 0) {
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+
+  pthread_mutex_lock(&f->lock);
+  cache_blocks_init(f, size);
+  f->ino = st.st_ino;
+  free(f->blocks_etag);
+  f->blocks_etag = (f->etag != NULL) ? strdup(f->etag) : NULL;
+  pthread_mutex_unlock(&f->lock);
+
+  /* an empty map first, so the file is never mistaken for a whole one */
+  if(cache.on && cache_blocks_save(f) != 0)
+    DEBUG("unable to save block map for %s\n", f->path);
+
+  return fd;
+}
+
+static int
+cache_fetch_blocks(struct file *f, int fd, size_t block, size_t n)
+{
+  off_t offset = (off_t) block * cache.block_size;
+  off_t size   = (off_t) n * cache.block_size;
+
+  if(offset + size > f->size)
+    size = f->size - offset;
+
+  DEBUG("fetch: %s blocks %zu-%zu\n", f->path, block, block + n - 1);
+
+  return proxy_read(f->path, fd, offset, size);
+}
+
+/* must be called with f->lock held */
+static void
+cache_blocks_landed(struct file *f, size_t block, size_t n, int result)
+{
+  size_t i;
+
+  for(i = block; i < block + n; i++) {
+    BLOCK_CLEAR(f->fetching, i);
+    if(result == 0) {
+      BLOCK_SET(f->blocks, i);
+      f->missing--;
+    }
+  }
+
+  pthread_cond_broadcast(&f->cond);
+
+  if(f->missing == 0) {
+    cache_blocks_free(f);
+    f->completed = true;
+  }
+}
+
+/* record a cache file that just became whole, from then on it is
+   revalidated by ETag alone */
+static void
+cache_blocks_completed(struct file *f)
+{
+  bool completed;
+
+  pthread_mutex_lock(&f->lock);
+  completed = f->completed;
+  pthread_mutex_unlock(&f->lock);
+
+  if(completed && cache.on && cache_blocks_save(f) != 0)
+    DEBUG("unable to save block map for %s\n", f->path);
+}
+
+/* the cache file holds what was just uploaded, adopt the ETag the
+   upload returned so the file isn't fetched again once it is
+   revalidated */
+static void
+cache_uploaded(struct file *f, int fd, const char *etag)
+{
+  struct stat cst;
+
+  if(etag == NULL || fstat(fd, &cst) != 0)
+    return;
+
+  /* parts copied server side may have been left unfetched, the
+     blocks that are present carry over to the new version */
+  pthread_mutex_lock(&f->lock);
+  if(f->blocks == NULL || cst.st_size >= f->size) {
+    free(f->etag);
+    f->etag = strdup(etag);
+    free(f->blocks_etag);
+    f->blocks_etag = strdup(etag);
+    f->ino = cst.st_ino;
+    if(f->blocks != NULL)
+      cache_blocks_grow(f, cst.st_size);
+    f->size = cst.st_size;
+    f->completed = (f->blocks == NULL) ? true : false;
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+/* make sure every block backing [offset, offset + size) is present
+   in the cache file, fetching missing runs of blocks with ranged GETs
+   and waiting on blocks another thread is already fetching. */
+static int
+cache_fetch(struct file *f, int fd, off_t offset, size_t size)
+{
+  int result = 0;
+  size_t i, n, last;
+
+  pthread_mutex_lock(&f->lock);
+  if(f->blocks == NULL || size == 0 || offset >= f->size) {
+    pthread_mutex_unlock(&f->lock);
+    return 0;
+  }
+
+  i = offset / cache.block_size;
+  last = (offset + size - 1) / cache.block_size;
+  if(last >= f->nblocks)
+    last = f->nblocks - 1;
+
+  while(f->blocks != NULL && i <= last) {
+    if(BLOCK_ISSET(f->blocks, i)) {
+      i++;
+      continue;
+    }
+
+    if(BLOCK_ISSET(f->fetching, i)) {
+      pthread_cond_wait(&f->cond, &f->lock);
+      continue;
+    }
+
+    for(n = i; n <= last; n++) {
+      if(BLOCK_ISSET(f->blocks, n) || BLOCK_ISSET(f->fetching, n))
+        break;
+      BLOCK_SET(f->fetching, n);
+    }
+
+    pthread_mutex_unlock(&f->lock);
+    result = cache_fetch_blocks(f, fd, i, n - i);
+    pthread_mutex_lock(&f->lock);
+
+    cache_blocks_landed(f, i, n - i, result);
+    if(result != 0)
+      break;
+
+    i = n;
+  }
+  pthread_mutex_unlock(&f->lock);
+
+  cache_blocks_completed(f);
+
+  return result;
+}
+
+static void
+readahead_fetch(struct fetch *fetch, void *data)
+{
+  int result;
+  struct file *f = fetch->f;
+
+  result = cache_fetch_blocks(f, fetch->fd, fetch->block, 1);
+
+  pthread_mutex_lock(&f->lock);
+  cache_blocks_landed(f, fetch->block, 1, result);
+  pthread_mutex_unlock(&f->lock);
+
+  cache_blocks_completed(f);
+
+  pthread_mutex_lock(&ra.lock);
+  ra.inflight -= cache.block_size;
+  pthread_mutex_unlock(&ra.lock);
+
+  close(fetch->fd);
+  cache_release(f);
+  g_free(fetch);
+}
+
+static bool
+readahead_reserve(void)
+{
+  bool reserved = false;
+
+  pthread_mutex_lock(&ra.lock);
+  if(ra.inflight + cache.block_size <= ra.max) {
+    ra.inflight += cache.block_size;
+    reserved = true;
+  }
+  pthread_mutex_unlock(&ra.lock);
+
+  return reserved;
+}
+
+/* queue background fetches for the blocks following a read. The
+   window starts at a single block once the file is read sequentially
+   and doubles every time the reader moves on to the next block, up to
+   readahead_max bytes. Any other access pattern resets it. */
+static void
+readahead_blocks(struct handle *h, off_t offset)
+{
+  size_t i, block, last, max;
+  struct file *f = h->f;
+
+  if(ra.pool == NULL)
+    return;
+
+  pthread_mutex_lock(&f->lock);
+  if(f->blocks == NULL || offset >= f->size) {
+    pthread_mutex_unlock(&f->lock);
+    return;
+  }
+
+  block = offset / cache.block_size;
+  if(block != h->block && block != h->block + 1) {
+    h->block = block;
+    h->window = 0;
+    h->ahead = block + 1;
+    pthread_mutex_unlock(&f->lock);
+    return;
+  }
+
+  max = ra.max / cache.block_size;
+  if(h->window == 0)
+    h->window = 1;
+  else if(block != h->block && h->window < max)
+    h->window = MIN(h->window * 2, max);
+  h->block = block;
+
+  i = MAX(h->ahead, block + 1);
+  last = MIN(block + h->window, f->nblocks - 1);
+  for(; i <= last; i++) {
+    struct fetch *fetch;
+
+    if(BLOCK_ISSET(f->blocks, i) || BLOCK_ISSET(f->fetching, i))
+      continue;
+
+    if(!readahead_reserve())
+      break;
+
+    fetch = g_new0(struct fetch, 1);
+    if((fetch->fd = dup(h->fd)) == -1) {
+      perror("dup");
+      g_free(fetch);
+      pthread_mutex_lock(&ra.lock);
+      ra.inflight -= cache.block_size;
+      pthread_mutex_unlock(&ra.lock);
+      break;
+    }
+
+    cache_ref(f);
+    fetch->f = f;
+    fetch->block = i;
+    BLOCK_SET(f->fetching, i);
+    g_thread_pool_push(ra.pool, fetch, NULL);
+  }
+
+  h->ahead = i;
+  pthread_mutex_unlock(&f->lock);
+}
+
+static int
+readahead_init(void)
+{
+  int threads;
+
+  ra.max = stormfs.readahead_max;
+  ra.inflight = 0;
+  ra.pool = NULL;
+  pthread_mutex_init(&ra.lock, NULL);
+
+  if(!cache.lazy || ra.max < cache.block_size)
+    return 0;
+
+  threads = ra.max / cache.block_size;
+  if(threads > MAX_READAHEAD_THREADS)
+    threads = MAX_READAHEAD_THREADS;
+
+  ra.pool = g_thread_pool_new((GFunc) readahead_fetch,
+      NULL, threads, FALSE, NULL);
+  if(ra.pool == NULL)
+    return -1;
+
+  return 0;
+}
+
+static int
+readahead_destroy(void)
+{
+  /* let queued fetches finish, they hold cache references */
+  if(ra.pool != NULL)
+    g_thread_pool_free(ra.pool, FALSE, TRUE);
+  pthread_mutex_destroy(&ra.lock);
+
+  return 0;
+}
+
+/* fetch every missing block of a cache file in the background, in
+   order. The first request is a single block so readers waiting on
+   the start of the file are served quickly, each request after that
+   doubles up to dl.max blocks. Readers ahead of the download fetch
+   their own blocks through cache_fetch. */
+static void
+download_fetch(struct fetch *fetch, void *data)
+{
+  int result;
+  size_t i, n, run = 1;
+  struct file *f = fetch->f;
+  ino_t ino;
+
+  pthread_mutex_lock(&f->lock);
+  ino = f->ino;
+  i = 0;
+  while(!dl.stop && f->blocks != NULL && f->ino == ino && i < f->nblocks) {
+    if(BLOCK_ISSET(f->blocks, i) || BLOCK_ISSET(f->fetching, i)) {
+      i++;
+      continue;
+    }
+
+    for(n = i; n < f->nblocks && n < i + run; n++) {
+      if(BLOCK_ISSET(f->blocks, n) || BLOCK_ISSET(f->fetching, n))
+        break;
+      BLOCK_SET(f->fetching, n);
+    }
+
+    pthread_mutex_unlock(&f->lock);
+    result = cache_fetch_blocks(f, fetch->fd, i, n - i);
+    pthread_mutex_lock(&f->lock);
+
+    cache_blocks_landed(f, i, n - i, result);
+    if(result != 0)
+      break;
+
+    i = n;
+    run = MIN(run * 2, dl.max);
+  }
+  pthread_mutex_unlock(&f->lock);
+
+  cache_blocks_completed(f);
+
+  close(fetch->fd);
+  cache_release(f);
+  g_free(fetch);
+}
+
+static void
+download_start(struct file *f, int fd)
+{
+  struct fetch *fetch = g_new0(struct fetch, 1);
+
+  if((fetch->fd = dup(fd)) == -1) {
+    perror("dup");
+    g_free(fetch);
+    return;
+  }
+
+  cache_ref(f);
+  fetch->f = f;
+  g_thread_pool_push(dl.pool, fetch, NULL);
+}
+
+static int
+download_init(void)
+{
+  dl.stop = false;
+  dl.max = (size_t) stormfs.download_part_size *
+    stormfs.download_connections / cache.block_size;
+  if(dl.max == 0)
+    dl.max = 1;
+
+  dl.pool = g_thread_pool_new((GFunc) download_fetch,
+      NULL, MAX_DOWNLOAD_THREADS, FALSE, NULL);
+  if(dl.pool == NULL)
+    return -1;
+
+  return 0;
+}
+
+static int
+download_destroy(void)
+{
+  /* running downloads stop after their current request */
+  dl.stop = true;
+  g_thread_pool_free(dl.pool, FALSE, TRUE);
+
+  return 0;
+}
+
+/* remove an unused file and its block map from the cache directory.
+   Entries referenced by open handles or background fetches are kept,
+   cache.lock makes sure none is taken while the file goes away. */
+static bool
+lru_evict_file(struct lru_entry *e)
+{
+  char *cp, *bp;
+  struct file *f;
+
+  pthread_mutex_lock(&cache.lock);
+  f = g_hash_table_lookup(cache.files, e->path);
+  if(f != NULL && f->refs > 1) {
+    pthread_mutex_unlock(&cache.lock);
+    return false;
+  }
+
+  if(asprintf(&cp, "%s%s", cache.path, e->path) == -1 ||
+      asprintf(&bp, "%s%s", cache.blocks_path, e->path) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  DEBUG("evict: %s\n", e->path);
+  unlink(cp);
+  unlink(bp);
+  pthread_mutex_unlock(&cache.lock);
+
+  free(cp);
+  free(bp);
+
+  return true;
+}
+
+/* the entry for c, as long as it wasn't touched since c was taken.
+   Must be called with lru.lock held. */
+static GList *
+lru_unchanged(struct lru_candidate *c)
+{
+  GList *link = g_hash_table_lookup(lru.index, c->path);
+
+  if(link == NULL || ((struct lru_entry *) link->data)->seq != c->seq)
+    return NULL;
+
+  return link;
+}
+
+static void
+lru_forget(GList *link)
+{
+  struct lru_entry *e = link->data;
+
+  g_hash_table_remove(lru.index, e->path);
+  g_queue_delete_link(lru.order, link);
+  lru_entry_free(e);
+}
+
+/* measure what every indexed file uses on disk and, above the high
+   watermark, evict least recently used files down to the low one.
+   Files are measured off a copy of the index so that opens aren't held
+   up by the walk, those touched meanwhile are left alone. */
+static void
+lru_evict(void)
+{
+  size_t i, n;
+  off_t used = 0;
+  GList *link;
+  struct lru_candidate *cands;
+
+  pthread_mutex_lock(&lru.lock);
+  n = g_queue_get_length(lru.order);
+  cands = g_new0(struct lru_candidate, MAX(n, 1));
+  for(i = 0, link = g_queue_peek_head_link(lru.order); link != NULL;
+      i++, link = link->next) {
+    struct lru_entry *e = link->data;
+
+    cands[i].path = strdup(e->path);
+    cands[i].seq = e->seq;
+  }
+  pthread_mutex_unlock(&lru.lock);
+
+  for(i = 0; i < n; i++) {
+    char *cp;
+    struct stat st;
+
+    if(asprintf(&cp, "%s%s", cache.path, cands[i].path) == -1) {
+      fprintf(stderr, "unable to allocate memory\n");
+      exit(EXIT_FAILURE);
+    }
+
+    cands[i].size = 0;
+    if(lstat(cp, &st) == 0) {
+      cands[i].size = (off_t) st.st_blocks * 512;
+      used += cands[i].size;
+    } else if(errno == ENOENT)
+      cands[i].size = -1;
+
+    free(cp);
+  }
+
+  pthread_mutex_lock(&lru.lock);
+  for(i = 0; i < n; i++)
+    if(cands[i].size == -1 && (link = lru_unchanged(&cands[i])) != NULL)
+      lru_forget(link);
+  pthread_mutex_unlock(&lru.lock);
+
+  if(used > lru.high) {
+    DEBUG("cache: %jd bytes used, evicting\n", (intmax_t) used);
+
+    for(i = 0; i < n && used > lru.low; i++) {
+      if(cands[i].size < 0)
+        continue;
+
+      pthread_mutex_lock(&lru.lock);
+      if((link = lru_unchanged(&cands[i])) != NULL &&
+          lru_evict_file(link->data)) {
+        used -= cands[i].size;
+        lru_forget(link);
+      }
+      pthread_mutex_unlock(&lru.lock);
+    }
+  }
+
+  for(i = 0; i < n; i++)
+    free(cands[i].path);
+  g_free(cands);
+}
+
+static void *
+lru_evictor(void *data)
+{
+  struct timespec ts;
+
+  pthread_mutex_lock(&lru.lock);
+  while(!lru.stop) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += CACHE_EVICT_INTERVAL;
+    pthread_cond_timedwait(&lru.cond, &lru.lock, &ts);
+    if(lru.stop)
+      break;
+
+    pthread_mutex_unlock(&lru.lock);
+    lru_evict();
+    pthread_mutex_lock(&lru.lock);
+  }
+  pthread_mutex_unlock(&lru.lock);
+
+  return NULL;
+}
+
+static GList *lru_scanned = NULL;
+
+static int
+lru_scan_file(const char *fpath, const struct stat *st,
+    int type, struct FTW *ftwbuf)
+{
+  struct lru_entry *e;
+
+  if(type != FTW_F && type != FTW_SL)
+    return 0;
+
+  e = g_new0(struct lru_entry, 1);
+  e->path = strdup(fpath + strlen(cache.path));
+  e->size = (off_t) st->st_blocks * 512;
+  e->atime = MAX(st->st_atime, st->st_mtime);
+  lru_scanned = g_list_prepend(lru_scanned, e);
+
+  return 0;
+}
+
+static gint
+lru_cmp_atime(struct lru_entry *a, struct lru_entry *b)
+{
+  if(a->atime == b->atime)
+    return 0;
+
+  return (a->atime < b->atime) ? -1 : 1;
+}
+
+static int
+lru_init(void)
+{
+  GList *head;
+  off_t size = (off_t) stormfs.cache_size * 1024 * 1024;
+
+  lru.order = NULL;
+  if(!cache.on || size == 0)
+    return 0;
+
+  lru.high = size / 100 * CACHE_HIGH_WATERMARK;
+  lru.low  = size / 100 * CACHE_LOW_WATERMARK;
+  lru.stop = false;
+  lru.order = g_queue_new();
+  lru.index = g_hash_table_new(g_str_hash, g_str_equal);
+  pthread_cond_init(&lru.cond, NULL);
+  pthread_mutex_init(&lru.lock, NULL);
+
+  /* files left by earlier mounts, oldest first */
+  if(nftw(cache.path, lru_scan_file, 16, FTW_PHYS) == -1 && errno != ENOENT)
+    perror("nftw");
+
+  lru_scanned = g_list_sort(lru_scanned, (GCompareFunc) lru_cmp_atime);
+  for(head = lru_scanned; head != NULL; head = head->next) {
+    struct lru_entry *e = head->data;
+
+    g_queue_push_tail(lru.order, e);
+    g_hash_table_insert(lru.index, e->path, g_queue_peek_tail_link(lru.order));
+  }
+  g_list_free(lru_scanned);
+  lru_scanned = NULL;
+
+  if(pthread_create(&lru.evictor, NULL, lru_evictor, NULL) != 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+lru_destroy(void)
+{
+  struct lru_entry *e;
+
+  if(lru.order == NULL)
+    return 0;
+
+  pthread_mutex_lock(&lru.lock);
+  lru.stop = true;
+  pthread_cond_signal(&lru.cond);
+  pthread_mutex_unlock(&lru.lock);
+  pthread_join(lru.evictor, NULL);
+
+  while((e = g_queue_pop_head(lru.order)) != NULL)
+    lru_entry_free(e);
+  g_queue_free(lru.order);
+  g_hash_table_destroy(lru.index);
+  pthread_cond_destroy(&lru.cond);
+  pthread_mutex_destroy(&lru.lock);
+  lru.order = NULL;
+
+  return 0;
+}
+
+static struct stream *
+stream_new(struct file *f)
+{
+  struct stream *s = g_new0(struct stream, 1);
+
+  pthread_mutex_lock(&f->lock);
+  s->gen = f->gen;
+  pthread_mutex_unlock(&f->lock);
+
+  pthread_cond_init(&s->cond, NULL);
+  pthread_mutex_init(&s->lock, NULL);
+
+  return s;
+}
+
+/* the size of a streamed file isn't known up front, parts start at
+   upload_part_size and double every STREAM_PART_STEP parts so that
+   MAX_PARTS of them reach past 5TB */
+static size_t
+stream_part_size(int part_num)
+{
+  off_t size = (off_t) stormfs.upload_part_size <<
+    MIN((part_num - 1) / STREAM_PART_STEP, 20);
+
+  return MIN(size, FIVE_GB);
+}
+
+/* the first part to go out starts the upload, off the write path. The
+   others wait for it. */
+static struct multipart *
+stream_start(struct handle *h)
+{
+  int err = 0;
+  struct stat st;
+  struct multipart *mp = NULL;
+  struct stream *s = h->stream;
+
+  pthread_mutex_lock(&s->lock);
+  while(s->starting)
+    pthread_cond_wait(&s->cond, &s->lock);
+  if(s->mp != NULL || s->err != 0) {
+    mp = s->mp;
+    pthread_mutex_unlock(&s->lock);
+    return mp;
+  }
+  s->starting = true;
+  pthread_mutex_unlock(&s->lock);
+
+  if((err = stormfs_getattr_meta(h->f->path, &st)) == 0 &&
+      (mp = proxy_upload_init(h->f->path, &st)) == NULL)
+    err = -EIO;
+
+  pthread_mutex_lock(&s->lock);
+  s->starting = false;
+  s->mp = mp;
+  if(mp != NULL)
+    s->st = st;
+  if(err != 0 && s->err == 0)
+    s->err = err;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+
+  return mp;
+}
+
+static void
+stream_upload_part(struct stream_part *p, void *data)
+{
+  int result = -EIO;
+  struct multipart *mp;
+  struct handle *h = p->h;
+  struct stream *s = h->stream;
+
+  if((mp = stream_start(h)) != NULL)
+    result = proxy_upload_part(mp, p->num, h->fd, p->offset, p->size);
+
+  pthread_mutex_lock(&s->lock);
+  if(result != 0 && s->err == 0)
+    s->err = result;
+  s->inflight--;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+
+  g_free(p);
+}
+
+/* hand every part a sequential writer has moved past to the uploader.
+   A write behind what was already sent leaves the file to be uploaded
+   as a whole on release. */
+static void
+stream_written(struct handle *h, off_t offset, size_t size)
+{
+  struct stream *s = h->stream;
+
+  if(s == NULL)
+    return;
+
+  pthread_mutex_lock(&s->lock);
+  if(offset < s->sent)
+    s->broken = true;
+  if(offset + (off_t) size > s->next)
+    s->next = offset + size;
+
+  while(!s->broken && s->err == 0 &&
+      s->next - s->sent >= (off_t) stream_part_size(s->part_num + 1)) {
+    struct stream_part *p = g_new(struct stream_part, 1);
+
+    p->h = h;
+    p->num = ++s->part_num;
+    p->offset = s->sent;
+    p->size = stream_part_size(p->num);
+    s->sent += p->size;
+    s->inflight++;
+    g_thread_pool_push(su.pool, p, NULL);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* wait for the parts in flight and take over the upload */
+static struct multipart *
+stream_take(struct stream *s)
+{
+  struct multipart *mp;
+
+  pthread_mutex_lock(&s->lock);
+  while(s->inflight > 0)
+    pthread_cond_wait(&s->cond, &s->lock);
+  mp = s->mp;
+  s->mp = NULL;
+  pthread_mutex_unlock(&s->lock);
+
+  return mp;
+}
+
+/* upload the tail of a streamed file and complete it. Returns false
+   when the file has to be uploaded as a whole instead. */
+static bool
+stream_complete(struct handle *h, struct stat *st, char **etag)
+{
+  bool ok;
+  struct stat fst;
+  unsigned long gen;
+  struct multipart *mp;
+  struct stream *s = h->stream;
+
+  if((mp = stream_take(s)) == NULL)
+    return false;
+
+  pthread_mutex_lock(&h->f->lock);
+  gen = h->f->gen;
+  pthread_mutex_unlock(&h->f->lock);
+
+  /* the upload carries the attributes it was started with */
+  ok = !s->broken && s->err == 0 && gen == s->gen &&
+    fstat(h->fd, &fst) == 0 && fst.st_size >= s->sent &&
+    st->st_mode == s->st.st_mode &&
+    st->st_uid == s->st.st_uid && st->st_gid == s->st.st_gid;
+
+  if(ok && fst.st_size > s->sent)
+    ok = proxy_upload_part(mp, s->part_num + 1, h->fd,
+        s->sent, fst.st_size - s->sent) == 0;
+
+  if(!ok) {
+    proxy_upload_abort(mp);
+    return false;
+  }
+
+  return proxy_upload_complete(mp, etag) == 0;
+}
+
+static void
+stream_free(struct stream *s)
+{
+  struct multipart *mp;
+
+  if((mp = stream_take(s)) != NULL)
+    proxy_upload_abort(mp);
+
+  pthread_cond_destroy(&s->cond);
+  pthread_mutex_destroy(&s->lock);
+  g_free(s);
+}
+
+static int
+stream_init(void)
+{
+  su.on = (stormfs.stream_upload) ? true : false;
+  su.pool = NULL;
+
+  if(!su.on)
+    return 0;
+
+  su.pool = g_thread_pool_new((GFunc) stream_upload_part,
+      NULL, MAX_UPLOAD_THREADS, FALSE, NULL);
+  if(su.pool == NULL)
+    return -1;
+
+  return 0;
+}
+
+static int
+stream_destroy(void)
+{
+  if(su.pool != NULL)
+    g_thread_pool_free(su.pool, FALSE, TRUE);
+
+  return 0;
+}
+
+/* keep the cached size of an open file in step with its writes */
+static void
+handle_written(struct handle *h, off_t offset, size_t size)
+{
+  size_t i, last;
+  struct file *f = h->f;
+
+  if(size == 0)
+    return;
+
+  pthread_mutex_lock(&f->lock);
+  if(cache_valid(f) && f->st != NULL) {
+    if(offset + (off_t) size > f->st->st_size)
+      f->st->st_size = offset + size;
+    cache_touch(f);
+  }
+
+  /* blocks stay dirty until an upload holding them goes out, whichever
+     handle that upload comes from */
+  last = (offset + size - 1) / cache.block_size;
+  if(last >= f->ndirty) {
+    size_t len = (f->ndirty + 7) / 8;
+
+    f->dirty = g_realloc(f->dirty, last / 8 + 1);
+    memset(f->dirty + len, 0, last / 8 + 1 - len);
+    f->ndirty = last + 1;
+  }
+  for(i = offset / cache.block_size; i <= last; i++)
+    BLOCK_SET(f->dirty, i);
+  f->writes++;
+  pthread_mutex_unlock(&f->lock);
+
+  h->modified = true;
+  stream_written(h, offset, size);
+}
+
+static struct handle *
+handle_new(struct file *f, int fd, int flags)
+{
+  struct handle *h = g_new0(struct handle, 1);
+
+  h->f = f;
+  h->fd = fd;
+  h->ufd = fd;
+  h->flags = flags;
+  h->modified = (flags & (O_CREAT | O_TRUNC)) ? true : false;
+
+  pthread_mutex_lock(&f->lock);
+  h->gen = f->gen;
+  h->etag = (f->etag != NULL) ? strdup(f->etag) : NULL;
+  h->size = (f->st != NULL) ? f->st->st_size : 0;
+  if((flags & O_ACCMODE) != O_RDONLY)
+    f->writers++;
+  pthread_mutex_unlock(&f->lock);
+
+  /* files written from empty are uploaded in parts as they grow */
+  if(su.on && (flags & O_ACCMODE) != O_RDONLY && (flags & (O_CREAT | O_TRUNC)))
+    h->stream = stream_new(f);
+
+  return h;
+}
+
+static struct handle *
+get_handle(struct fuse_file_info *fi)
+{
+  return (struct handle *) (uintptr_t) fi->fh;
+}
+
+/* whether the file changed while open, by a write through this
+   handle or by a truncate of the path */
+static bool
+handle_modified(struct handle *h)
+{
+  bool modified;
+
+  if(h->modified)
+    return true;
+
+  pthread_mutex_lock(&h->f->lock);
+  modified = (h->f->gen != h->gen);
+  pthread_mutex_unlock(&h->f->lock);
+
+  return modified;
+}
+
+/* take the blocks to upload, before the data being uploaded is fixed */
+static void
+handle_take_dirty(struct handle *h)
+{
+  struct file *f = h->f;
+
+  pthread_mutex_lock(&f->lock);
+  g_free(h->written);
+  h->written = NULL;
+  h->nwritten = f->ndirty;
+  h->writes = f->writes;
+  if(f->dirty != NULL) {
+    h->written = g_malloc((f->ndirty + 7) / 8);
+    memcpy(h->written, f->dirty, (f->ndirty + 7) / 8);
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+/* everything written before the map was taken went out, forget it
+   unless the file was written again since */
+static void
+handle_clean(struct handle *h)
+{
+  struct file *f = h->f;
+
+  pthread_mutex_lock(&f->lock);
+  if(f->writes == h->writes) {
+    g_free(f->dirty);
+    f->dirty = NULL;
+    f->ndirty = 0;
+  }
+  pthread_mutex_unlock(&f->lock);
+}
+
+static bool
+handle_range_written(struct handle *h, off_t offset, off_t size)
+{
+  size_t i = offset / cache.block_size;
+  size_t last = (offset + size - 1) / cache.block_size;
+
+  for(; i <= last && i < h->nwritten; i++)
+    if(BLOCK_ISSET(h->written, i))
+      return true;
+
+  return false;
+}
+
+/* whether the file can be updated in place from the object h was
+   opened from */
+static bool
+handle_updatable(struct handle *h)
+{
+  unsigned long gen;
+
+  pthread_mutex_lock(&h->f->lock);
+  gen = h->f->gen;
+  pthread_mutex_unlock(&h->f->lock);
+
+  return h->etag != NULL && h->written != NULL && gen == h->gen &&
+    !(h->flags & (O_CREAT | O_TRUNC));
+}
+
+/* the parts of a size bytes upload that have to be sent, copied is set
+   when any part can be copied server side instead */
+static GList *
+handle_dirty_parts(struct handle *h, off_t size, bool *copied)
+{
+  off_t offset;
+  GList *dirty = NULL;
+  size_t part_size = stormfs_curl_part_size(size);
+
+  *copied = false;
+  for(offset = 0; offset < size; offset += part_size) {
+    struct extent *e;
+    off_t len = MIN((off_t) part_size, size - offset);
+
+    if(offset + len <= h->size && !handle_range_written(h, offset, len)) {
+      *copied = true;
+      continue;
+    }
+
+    e = g_new(struct extent, 1);
+    e->offset = offset;
+    e->size = len;
+    dirty = g_list_append(dirty, e);
+  }
+
+  return dirty;
+}
+
+static void
+free_extents(GList *extents)
+{
+  GList *p;
+
+  for(p = extents; p != NULL; p = p->next)
+    g_free(p->data);
+  g_list_free(extents);
+}
+
+/* re-upload a file changed in place. Only the parts holding writes not
+   uploaded yet, or lying past the end of the object it was opened from,
+   are sent, the rest is copied server side from that object. */
+static int
+handle_update(struct handle *h, struct stat *st, char **etag)
+{
+  int result = 0;
+  bool copied;
+  struct stat cst;
+  GList *head, *dirty = NULL;
+  struct file *f = h->f;
+
+  if(!handle_updatable(h))
+    return -ENOTSUP;
+
+  if(fstat(h->ufd, &cst) != 0)
+    return -errno;
+
+  dirty = handle_dirty_parts(h, cst.st_size, &copied);
+
+  /* parts sent from the cache file must hold all of their data */
+  for(head = dirty; result == 0 && head != NULL; head = head->next) {
+    struct extent *e = head->data;
+
+    result = cache_fetch(f, h->fd, e->offset, e->size);
+  }
+
+  if(result == 0)
+    result = (copied) ?
+      proxy_update(f->path, h->ufd, st, h->etag, dirty, etag) : -ENOTSUP;
+
+  free_extents(dirty);
+
+  return result;
+}
+
+/* whether what was uploaded is still what the cache file holds */
+static bool
+handle_current(struct handle *h)
+{
+  struct stat st;
+
+  if(h->ufd == h->fd)
+    return true;
+
+  return fstat(h->fd, &st) == 0 && st.st_size == h->snap.st_size &&
+    st.st_mtim.tv_sec == h->snap.st_mtim.tv_sec &&
+    st.st_mtim.tv_nsec == h->snap.st_mtim.tv_nsec;
+}
+
+static void
+handle_uploaded(struct handle *h, const char *etag)
+{
+  handle_clean(h);
+  if(handle_current(h))
+    cache_uploaded(h->f, h->fd, etag);
+}
+
+static int
+snapshot_copy(int from, int to)
+{
+  ssize_t n;
+  off_t offset = 0;
+  char *buf = g_malloc(SNAPSHOT_BUFFER);
+
+  while((n = pread(from, buf, SNAPSHOT_BUFFER, offset)) > 0) {
+    ssize_t written = 0;
+
+    while(written < n) {
+      ssize_t w = pwrite(to, buf + written, n - written, offset + written);
+
+      if(w == -1) {
+        g_free(buf);
+        return -errno;
+      }
+      written += w;
+    }
+
+    offset += n;
+  }
+
+  g_free(buf);
+
+  return (n == 0) ? 0 : -errno;
+}
+
+/* point-in-time copy of a cache file, so that writers reopening it
+   don't change what is being uploaded. Reflinked where the filesystem
+   supports it, copied otherwise. */
+static int
+snapshot_create(int fd)
+{
+  int sfd;
+  char *tmp;
+
+  if(asprintf(&tmp, "%s/XXXXXX", wb.snapshot_path) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  sfd = mkstemp(tmp);
+  if(sfd != -1)
+    unlink(tmp);
+  free(tmp);
+
+  if(sfd == -1)
+    return -1;
+
+#ifdef FICLONE
+  if(ioctl(sfd, FICLONE, fd) == 0)
+    return sfd;
+#endif
+
+  if(snapshot_copy(fd, sfd) != 0) {
+    close(sfd);
+    return -1;
+  }
+
+  return sfd;
+}
+
+/* a snapshot can only send the blocks present when it is taken. Those
+   of partial files are fetched first, only the parts an update sends
+   when it can be updated in place. */
+static int
+handle_fill(struct handle *h)
+{
+  int result = 0;
+  bool partial, copied = false;
+  struct stat st;
+  GList *head, *dirty = NULL;
+  struct file *f = h->f;
+
+  h->sparse = false;
+
+  pthread_mutex_lock(&f->lock);
+  partial = (f->blocks != NULL);
+  pthread_mutex_unlock(&f->lock);
+
+  if(!partial)
+    return 0;
+
+  if(handle_updatable(h)) {
+    if(fstat(h->fd, &st) != 0)
+      return -errno;
+    dirty = handle_dirty_parts(h, st.st_size, &copied);
+  }
+
+  if(!copied) {
+    free_extents(dirty);
+    return cache_fetch(f, h->fd, 0, f->size);
+  }
+
+  for(head = dirty; result == 0 && head != NULL; head = head->next) {
+    struct extent *e = head->data;
+
+    result = cache_fetch(f, h->fd, e->offset, e->size);
+  }
+  free_extents(dirty);
+
+  h->sparse = true;
+
+  return result;
+}
+
+/* upload from a point-in-time copy of the cache file, so that writers
+   reopening it don't change what is being sent */
+static int
+handle_snapshot(struct handle *h)
+{
+  int sfd, result;
+
+  handle_take_dirty(h);
+  if((result = handle_fill(h)) != 0)
+    return result;
+
+  if(fstat(h->fd, &h->snap) != 0 || (sfd = snapshot_create(h->fd)) == -1)
+    return -EIO;
+
+  h->ufd = sfd;
+
+  return 0;
+}
+
+/* upload the cache file behind a writable handle */
+static int
+handle_upload(struct handle *h)
+{
+  int result;
+  struct stat st;
+  char *etag = NULL;
+  struct file *f = h->f;
+
+  if((result = stormfs_getattr_meta(f->path, &st)) != 0)
+    return result;
+
+  /* snapshots took the map when they were taken */
+  if(h->ufd == h->fd)
+    handle_take_dirty(h);
+
+  if(handle_update(h, &st, &etag) == 0)
+    goto uploaded;
+
+  /* the whole object is uploaded, fill in any missing blocks. A snapshot
+     taken for an update lacks some, it is taken again. */
+  if(h->sparse) {
+    close(h->ufd);
+    h->ufd = h->fd;
+    h->sparse = false;
+  }
+
+  if((result = cache_fetch(f, h->fd, 0, f->size)) != 0)
+    return result;
+
+  if(wb.on && h->ufd == h->fd && h->stream == NULL &&
+      handle_snapshot(h) != 0)
+    handle_take_dirty(h);
+
+  if(fsync(h->fd) != 0)
+    return -errno;
+
+  /* most of a streamed file is uploaded already */
+  if(h->stream != NULL && stream_complete(h, &st, &etag))
+    goto uploaded;
+
+  /* journals name the cache file, not the snapshot sent from it */
+  if((result = proxy_release(f->path, h->ufd, &st,
+      (h->ufd != h->fd) ? &h->snap : NULL, &etag)) != 0)
+    return result;
+
+uploaded:
+  handle_uploaded(h, etag);
+  free(etag);
+
+  return 0;
+}
+
+/* uploads of a file run one at a time, so that an older version can't
+   land after a newer one. Returns false if h was superseded while
+   waiting its turn. */
+static bool
+handle_upload_begin(struct handle *h)
+{
+  bool run;
+  struct file *f = h->f;
+
+  pthread_mutex_lock(&f->lock);
+  while(f->uploading && !h->superseded)
+    pthread_cond_wait(&f->cond, &f->lock);
+  run = !h->superseded;
+  if(run)
+    f->uploading = true;
+  pthread_mutex_unlock(&f->lock);
+
+  return run;
+}
+
+static void
+handle_upload_end(struct handle *h)
+{
+  pthread_mutex_lock(&h->f->lock);
+  h->f->uploading = false;
+  pthread_cond_broadcast(&h->f->cond);
+  pthread_mutex_unlock(&h->f->lock);
+}
+
+/* upload h once the uploads of the file before it are done */
+static int
+handle_upload_serial(struct handle *h)
+{
+  int result;
+
+  if(!handle_upload_begin(h))
+    return -ECANCELED;
+
+  result = handle_upload(h);
+  handle_upload_end(h);
+
+  return result;
+}
+
+static int
+handle_free(struct handle *h)
+{
+  int result = 0;
+
+  if(h->stream != NULL)
+    stream_free(h->stream);
+
+  if(cache.on && cache_blocks_save(h->f) != 0)
+    DEBUG("unable to save block map for %s\n", h->f->path);
+
+  if(h->ufd != h->fd)
+    close(h->ufd);
+
+  if((h->flags & O_ACCMODE) != O_RDONLY) {
+    pthread_mutex_lock(&h->f->lock);
+    h->f->writers--;
+    pthread_mutex_unlock(&h->f->lock);
+  }
+
+  if(close(h->fd) != 0) {
+    perror("close");
+    result = -errno;
+  }
+
+  cache_release(h->f);
+  free(h->etag);
+  g_free(h->written);
+  g_free(h);
+
+  return result;
+}
+
+/* streamed files keep reading the cache file. Most of them went out
+   while they were written, and a writer changing them during the upload
+   marks its blocks dirty and queues an upload superseding this one, which
+   sends those blocks again. */
+static void
+writeback_snapshot(struct handle *h)
+{
+  if(h->stream != NULL)
+    return;
+
+  if(handle_snapshot(h) != 0)
+    DEBUG("unable to snapshot %s\n", h->f->path);
+}
+
+/* failed uploads are tried again, backing off up to WRITEBACK_RETRY_MAX
+   seconds, until they go out, are superseded or the filesystem is
+   unmounted */
+static bool
+writeback_retry(struct handle *h, int result, int *delay)
+{
+  bool retry;
+  struct timespec ts;
+
+  if(result == -ECANCELED || result == -EFBIG)
+    return false;
+
+  fprintf(stderr, "%s: unable to upload %s, retrying in %ds: %s\n",
+      stormfs.progname, h->f->path, *delay, strerror(-result));
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += *delay;
+  pthread_mutex_lock(&wb.lock);
+  while(!wb.stop && !h->superseded &&
+      pthread_cond_timedwait(&wb.cond, &wb.lock, &ts) != ETIMEDOUT)
+    ;
+  retry = !wb.stop;
+  pthread_mutex_unlock(&wb.lock);
+
+  *delay = MIN(*delay * 2, WRITEBACK_RETRY_MAX);
+
+  return retry;
+}
+
+static void
+writeback_upload(struct handle *h, void *data)
+{
+  int result;
+  int delay = 1;
+  struct file *f = h->f;
+
+  /* a newer version of the file is on its way, this one can go. The
+     file stays pending, and its blocks dirty, while it is retried. */
+  stormfs_curl_cancel_on(&h->superseded);
+  while((result = handle_upload_serial(h)) != 0 &&
+      writeback_retry(h, result, &delay))
+    ;
+  stormfs_curl_cancel_on(NULL);
+
+  if(result == -ECANCELED)
+    DEBUG("superseded upload of %s\n", f->path);
+  else if(result != 0)
+    fprintf(stderr, "%s: unable to upload %s: %s\n",
+        stormfs.progname, f->path, strerror(-result));
+
+  pthread_mutex_lock(&wb.lock);
+  wb.dirty -= h->dirty;
+  wb.queued--;
+  pthread_cond_broadcast(&wb.cond);
+  pthread_mutex_unlock(&wb.lock);
+
+  pthread_mutex_lock(&f->lock);
+  f->pending--;
+  if(f->upload == h)
+    f->upload = NULL;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+
+  handle_free(h);
+}
+
+/* hand a released, writable handle to the uploader pool, uploading
+   from a snapshot and superseding any older upload of the file.
+   Callers block while writeback_max bytes are already waiting to go
+   out. */
+static void
+writeback_queue(struct handle *h)
+{
+  struct stat st;
+  size_t size = (fstat(h->fd, &st) == 0) ? st.st_size : 0;
+
+  writeback_snapshot(h);
+
+  pthread_mutex_lock(&wb.lock);
+  while(wb.dirty > 0 && wb.dirty + size > wb.max)
+    pthread_cond_wait(&wb.cond, &wb.lock);
+  wb.dirty += size;
+  wb.queued++;
+  pthread_mutex_unlock(&wb.lock);
+
+  h->dirty = size;
+
+  pthread_mutex_lock(&h->f->lock);
+  h->f->pending++;
+  if(h->f->upload != NULL)
+    h->f->upload->superseded = true;
+  h->f->upload = h;
+  pthread_cond_broadcast(&h->f->cond);
+  pthread_mutex_unlock(&h->f->lock);
+
+  /* wake a superseded upload backing off */
+  pthread_mutex_lock(&wb.lock);
+  pthread_cond_broadcast(&wb.cond);
+  pthread_mutex_unlock(&wb.lock);
+
+  g_thread_pool_push(wb.pool, h, NULL);
+}
+
+/* wait for queued uploads of path, before the object is changed
+   behind their back */
+static void
+writeback_wait(const char *path)
+{
+  struct file *f;
+
+  if(!wb.on)
+    return;
+
+  f = cache_acquire(path);
+  pthread_mutex_lock(&f->lock);
+  while(f->pending > 0)
+    pthread_cond_wait(&f->cond, &f->lock);
+  pthread_mutex_unlock(&f->lock);
+  cache_release(f);
+}
+
+/* wait for every queued upload */
+static void
+writeback_drain(void)
+{
+  if(!wb.on)
+    return;
+
+  pthread_mutex_lock(&wb.lock);
+  while(wb.queued > 0)
+    pthread_cond_wait(&wb.cond, &wb.lock);
+  pthread_mutex_unlock(&wb.lock);
+}
+
+/* upload again whatever an earlier mount left unfinished, as long as
+   the cache file still holds what was being sent. Parts that already
+   went out aren't sent again. */
+static void *
+writeback_resume(void *data)
+{
+  GList *head = NULL, *paths = stormfs_curl_journaled();
+
+  for(head = paths; head != NULL; head = head->next) {
+    int fd = -1;
+    int result;
+    struct handle *h;
+    struct file *f = cache_acquire(head->data);
+
+    if(cache_file_exists(f))
+      fd = cache_open_file(f);
+
+    if(!stormfs_curl_journal_valid(f->path, fd)) {
+      if(fd != -1)
+        close(fd);
+      cache_release(f);
+      continue;
+    }
+
+    DEBUG("resuming upload of %s\n", f->path);
+    h = handle_new(f, fd, O_RDWR);
+    h->modified = true;
+    if(wb.on) {
+      writeback_queue(h);
+      continue;
+    }
+
+    if((result = handle_upload_serial(h)) != 0)
+      fprintf(stderr, "%s: unable to upload %s: %s\n",
+          stormfs.progname, f->path, strerror(-result));
+    handle_free(h);
+  }
+
+  for(head = paths; head != NULL; head = head->next)
+    free(head->data);
+  g_list_free(paths);
+
+  return NULL;
+}
+
+static int
+writeback_init(void)
+{
+  wb.on = (stormfs.writeback) ? true : false;
+  wb.stop = false;
+  wb.max = (size_t) stormfs.writeback_max * 1024 * 1024;
+  wb.dirty = 0;
+  wb.queued = 0;
+  wb.pool = NULL;
+  pthread_cond_init(&wb.cond, NULL);
+  pthread_mutex_init(&wb.lock, NULL);
+
+  // bucket names never start with a dot.
+  if(asprintf(&wb.snapshot_path, "%s/.snapshots/%s",
+      stormfs.cache_path, stormfs.bucket) == -1) {
+    fprintf(stderr, "unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(wb.on) {
+    if(g_mkdir_with_parents(wb.snapshot_path, S_IRWXU) != 0)
+      perror("mkdir");
+
+    wb.pool = g_thread_pool_new((GFunc) writeback_upload,
+        NULL, MAX_UPLOAD_THREADS, FALSE, NULL);
+    if(wb.pool == NULL)
+      return -1;
+  }
+
+  if(pthread_create(&wb.resumer, NULL, writeback_resume, NULL) != 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+writeback_destroy(void)
+{
+  /* every queued upload goes out before unmounting, those still failing
+     are given up on, only journaled ones resume on the next mount */
+  pthread_join(wb.resumer, NULL);
+  pthread_mutex_lock(&wb.lock);
+  wb.stop = true;
+  pthread_cond_broadcast(&wb.cond);
+  pthread_mutex_unlock(&wb.lock);
+  if(wb.pool != NULL)
+    g_thread_pool_free(wb.pool, FALSE, TRUE);
+  pthread_cond_destroy(&wb.cond);
+  pthread_mutex_destroy(&wb.lock);
+  free(wb.snapshot_path);
+
+  return 0;
+}
+
+static int
+validate_mountpoint(const char *path, struct stat *stbuf)
+{
+  DIR *d;
+
+  DEBUG("validating mountpoint: %s\n", path);
+
+  if(stat(path, stbuf) == -1) {
+    fprintf(stderr, "%s: unable to stat MOUNTPOINT %s: %s\n",
+        stormfs.progname, path, strerror(errno));
+    return -1;
+  }
+
+  if((d = opendir(path)) == NULL) {
+    fprintf(stderr, "%s: unable to open MOUNTPOINT %s: %s\n",
+        stormfs.progname, path, strerror(errno));
+    return -1;
+  }
 
   closedir(d);
 
@@ -596,10 +3171,37 @@ add_optional_headers(GList *headers)
   return headers;
 }
 
+static int
+getattr_fetch(const char *path, struct file *f, struct stat *stbuf)
+{
+  int result;
+  char *etag = NULL;
+
+  if((result = proxy_getattr(path, stbuf, &etag)) != 0)
+    return result;
+
+  stbuf->st_nlink = 1;
+  if(S_ISREG(stbuf->st_mode))
+    stbuf->st_blocks = get_blocks(stbuf->st_size);
+
+  pthread_mutex_lock(&f->lock);
+  if(f->st == NULL)
+    f->st = g_new0(struct stat, 1);
+  memcpy(f->st, stbuf, sizeof(struct stat));
+  free(f->etag);
+  f->etag = etag;
+  f->lazy_meta = false;
+  cache_touch(f);
+  pthread_mutex_unlock(&f->lock);
+
+  return 0;
+}
+
 int
 stormfs_getattr(const char *path, struct stat *stbuf)
 {
   int result;
+  bool cached;
   struct file *f = NULL;
 
   DEBUG("getattr: %s\n", path);
@@ -612,27 +3214,44 @@ stormfs_getattr(const char *path, struct stat *stbuf)
     return 0;
   }
 
+  /* files waiting to be uploaded only exist here */
   f = cache_get(path);
-  if(cache_valid(f) && f->st != NULL) {
+  pthread_mutex_lock(&f->lock);
+  cached = (cache_valid(f) || f->pending > 0) && f->st != NULL;
+  if(cached)
     memcpy(stbuf, f->st, sizeof(struct stat));
+  pthread_mutex_unlock(&f->lock);
+
+  if(cached)
     return 0;
-  }
 
-  if((result = proxy_getattr(path, stbuf)) != 0)
+  return getattr_fetch(path, f, stbuf);
+}
+
+/* getattr for callers that write the metadata back to the object,
+   entries stat'ed from a listing fetch the real x-amz-meta-* first */
+int
+stormfs_getattr_meta(const char *path, struct stat *stbuf)
+{
+  bool lazy;
+  int result;
+  struct file *f;
+
+  if((result = valid_path(path)) != 0)
     return result;
 
-  stbuf->st_nlink = 1;
-  if(S_ISREG(stbuf->st_mode))
-    stbuf->st_blocks = get_blocks(stbuf->st_size);
+  if(strcmp(path, "/") == 0)
+    return stormfs_getattr(path, stbuf);
 
+  f = cache_get(path);
   pthread_mutex_lock(&f->lock);
-  if(f->st == NULL)
-    f->st = g_new0(struct stat, 1);
-  memcpy(f->st, stbuf, sizeof(struct stat));
-  cache_touch(f);
+  lazy = f->lazy_meta;
   pthread_mutex_unlock(&f->lock);
 
-  return 0;
+  if(!lazy)
+    return stormfs_getattr(path, stbuf);
+
+  return getattr_fetch(path, f, stbuf);
 }
 
 int
@@ -645,6 +3264,8 @@ stormfs_unlink(const char *path)
   if((result = valid_path(path)) != 0)
     return result;
 
+  writeback_wait(path);
+
   if((result = proxy_unlink(path)) != 0)
     return result;
 
@@ -666,14 +3287,23 @@ stormfs_truncate(const char *path, off_t size)
   if((result = valid_path(path)) != 0)
     return result;
 
-  if((result = stormfs_getattr(path, &st)) != 0)
+  if((result = stormfs_getattr_meta(path, &st)) != 0)
     return -result;
 
   f = cache_get(path);
   if(cache_file_valid(f)) {
     char *cp = cache_path(f);
+
+    pthread_mutex_lock(&f->lock);
+    while(cache_blocks_fetching(f))
+      pthread_cond_wait(&f->cond, &f->lock);
+
     if((result = truncate(cp, size)) != 0)
       perror("truncate");
+    cache_blocks_truncate(f, size);
+    f->gen++;
+    pthread_mutex_unlock(&f->lock);
+
     free(cp);
   } else {
     fd = cache_create_file(f);
@@ -691,9 +3321,9 @@ stormfs_truncate(const char *path, off_t size)
 static int
 stormfs_open(const char *path, struct fuse_file_info *fi)
 {
-  FILE *fp;
   int fd;
   int result;
+  struct stat st;
   struct file *f;
 
   DEBUG("open: %s\n", path);
@@ -705,35 +3335,43 @@ stormfs_open(const char *path, struct fuse_file_info *fi)
     if((result = stormfs_truncate(path, 0)) != 0)
       return result;
 
-  f = cache_get(path);
-  if(cache_file_valid(f)) {
-    char *cp = cache_path(f);
+  /* writers upload the metadata along with the data */
+  if((fi->flags & O_ACCMODE) != O_RDONLY)
+    result = stormfs_getattr_meta(path, &st);
+  else
+    result = stormfs_getattr(path, &st);
+  if(result != 0)
+    return result;
 
-    fp = fopen(cp, "a+");
-    free(cp);
+  f = cache_acquire(path);
+  if(cache_file_valid(f)) {
+    if((fd = cache_open_file(f)) == -1) {
+      result = -errno;
+      cache_release(f);
+      return result;
+    }
 
-    if(fp == NULL)
-      return -errno;
-    if((fd = fileno(fp)) == -1)
-      return -errno;
+    // pick up where an earlier download left off
+    if(!cache.lazy && f->blocks != NULL)
+      download_start(f, fd);
 
-    fi->fh = fd;
+    fi->fh = (uintptr_t) handle_new(f, fd, fi->flags);
 
     return 0;
   }
 
-  // file not available in cache, download it.
-  if((fd = cache_create_file(f)) == -1)
-    return -1; // FIXME: need to return proper errors here.
-  if((fp = fdopen(fd, "a+")) == NULL)
-    return -errno;
-
-  if((result = proxy_open(path, fp)) != 0) {
-    fclose(fp);
-    return result;
+  /* file not available in cache, fetch blocks as they are read or,
+     unless lazy, download it in the background while reads wait for
+     the blocks they need. */
+  if((fd = cache_create_sparse(f, st.st_size)) == -1) {
+    cache_release(f);
+    return -EIO;
   }
 
-  fi->fh = fd;
+  if(!cache.lazy)
+    download_start(f, fd);
+
+  fi->fh = (uintptr_t) handle_new(f, fd, fi->flags);
 
   return result;
 }
@@ -741,9 +3379,11 @@ stormfs_open(const char *path, struct fuse_file_info *fi)
 static int
 stormfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+  int fd;
   int result;
   struct stat st;
   struct file *f;
+  struct handle *h;
 
   DEBUG("create: %s\n", path);
 
@@ -752,8 +3392,13 @@ stormfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
   cache_invalidate_dir(path);
 
-  f = cache_get(path);
-  fi->fh = cache_create_file(f);
+  f = cache_acquire(path);
+  if((fd = cache_create_file(f)) < 0) {
+    cache_release(f);
+    return -EIO;
+  }
+
+  h = handle_new(f, fd, fi->flags | O_CREAT);
 
   st.st_gid = getgid();
   st.st_uid = getuid();
@@ -761,13 +3406,18 @@ stormfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
   st.st_ctime = time(NULL);
   st.st_mtime = time(NULL);
 
-  if((result = proxy_create(path, &st)) != 0)
+  if((result = proxy_create(path, &st)) != 0) {
+    handle_free(h);
     return result;
+  }
+
+  fi->fh = (uintptr_t) h;
 
   pthread_mutex_lock(&f->lock);
   if(f->st == NULL)
     f->st = g_new0(struct stat, 1);
   memcpy(f->st, &st, sizeof(struct stat));
+  f->lazy_meta = false;
   cache_touch(f);
   pthread_mutex_unlock(&f->lock);
 
@@ -786,7 +3436,7 @@ stormfs_chmod(const char *path, mode_t mode)
   if((result = valid_path(path)) != 0)
     return result;
 
-  if((result = stormfs_getattr(path, &st)) != 0)
+  if((result = stormfs_getattr_meta(path, &st)) != 0)
     return result;
 
   st.st_mode = mode;
@@ -821,7 +3471,7 @@ stormfs_chown(const char *path, uid_t uid, gid_t gid)
   if((result = valid_path(path)) != 0)
     return result;
 
-  if((result = stormfs_getattr(path, &st)) != 0)
+  if((result = stormfs_getattr_meta(path, &st)) != 0)
     return result;
 
   st.st_uid = uid;
@@ -900,6 +3550,7 @@ stormfs_mknod(const char *path, mode_t mode, dev_t rdev)
   if(f->st == NULL)
     f->st = g_new0(struct stat, 1);
   memcpy(f->st, &st, sizeof(struct stat));
+  f->lazy_meta = false;
   cache_touch(f);
   pthread_mutex_unlock(&f->lock);
 
@@ -910,73 +3561,401 @@ static int
 stormfs_read(const char *path, char *buf, size_t size, off_t offset,
     struct fuse_file_info *fi)
 {
+  int result;
+  struct handle *h = get_handle(fi);
+
   DEBUG("read: %s\n", path);
 
-  return pread(fi->fh, buf, size, offset);
+  readahead_blocks(h, offset);
+  if((result = cache_fetch(h->f, h->fd, offset, size)) != 0)
+    return result;
+
+  if((result = pread(h->fd, buf, size, offset)) == -1)
+    return -errno;
+
+  return result;
 }
 
+#if FUSE_VERSION >= 29
+/* hand libfuse the cache fd rather than a copy of its contents, so
+   the data can be spliced from the page cache to /dev/fuse. */
 static int
-stormfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset, struct fuse_file_info *fi)
+stormfs_read_buf(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t offset, struct fuse_file_info *fi)
 {
   int result;
-  struct file *dir;
-  GList *files = NULL, *head = NULL, *next = NULL;
+  struct fuse_bufvec *src;
+  struct handle *h = get_handle(fi);
 
-  DEBUG("readdir: %s\n", path);
+  DEBUG("read_buf: %s\n", path);
 
-  if((result = valid_path(path)) != 0)
+  readahead_blocks(h, offset);
+  if((result = cache_fetch(h->f, h->fd, offset, size)) != 0)
     return result;
 
-  filler(buf, ".",  0, 0);
-  filler(buf, "..", 0, 0);
+  // libfuse releases the vector with free(3)
+  if((src = malloc(sizeof(struct fuse_bufvec))) == NULL)
+    return -ENOMEM;
+
+  *src = FUSE_BUFVEC_INIT(size);
+  src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  src->buf[0].fd = h->fd;
+  src->buf[0].pos = offset;
+  *bufp = src;
 
-  dir = cache_get(path);
-  if(cache_valid(dir) && dir->dir != NULL) {
-    pthread_mutex_lock(&dir->lock);
-    head = g_list_first(dir->dir);
-    while(head != NULL) {
-      next = head->next;
-      struct file *f = head->data;
-      filler(buf, (char *) f->name, f->st, 0);
-      head = next;
+  return 0;
+}
+#endif
+
+/* entries whose metadata was fetched keep it while their ETag is
+   unchanged, instead of reverting to what the listing says */
+static bool
+readdir_known(const char *path, struct file *file)
+{
+  bool known = false;
+  struct file *f;
+  char *fullpath = get_path(path, file->name);
+
+  pthread_mutex_lock(&cache.lock);
+  if((f = g_hash_table_lookup(cache.files, fullpath)) != NULL)
+    f->refs++;
+  pthread_mutex_unlock(&cache.lock);
+  free(fullpath);
+
+  if(f == NULL)
+    return false;
+
+  pthread_mutex_lock(&f->lock);
+  if(f->st != NULL && !f->lazy_meta && f->etag != NULL &&
+      file->etag != NULL && strcmp(f->etag, file->etag) == 0) {
+    memcpy(file->st, f->st, sizeof(struct stat));
+    known = true;
+  }
+  pthread_mutex_unlock(&f->lock);
+  cache_release(f);
+
+  return known;
+}
+
+/* with fast_readdir, entries are stat'ed from what the listing returned,
+   only those that might not be regular files are HEAD'ed. Their mtime
+   is the object's LastModified, not x-amz-meta-mtime. */
+static int
+readdir_getattr(const char *path, GList *files)
+{
+  int result = 0;
+  GList *head, *ambiguous = NULL;
+
+  if(!stormfs.fast_readdir)
+    return proxy_getattr_multi(path, files);
+
+  for(head = g_list_first(files); head != NULL; head = head->next) {
+    struct file *f = head->data;
+
+    if(readdir_known(path, f))
+      continue;
+
+    /* directories, devices and empty files all list as 0 bytes */
+    if(f->st->st_size == 0) {
+      ambiguous = g_list_prepend(ambiguous, f);
+      continue;
     }
-    pthread_mutex_unlock(&dir->lock);
-    return 0;
+
+    f->st->st_mode = S_IFREG | stormfs.default_mode;
+    f->st->st_uid = stormfs.default_uid;
+    f->st->st_gid = stormfs.default_gid;
+    f->st->st_ctime = f->st->st_mtime;
+    f->st->st_blocks = get_blocks(f->st->st_size);
+    f->lazy_meta = true;
   }
 
-  if((result = proxy_readdir(path, &files)) != 0)
-    return result;
+  if(ambiguous != NULL)
+    result = proxy_getattr_multi(path, ambiguous);
+  g_list_free(ambiguous);
 
-  result = proxy_getattr_multi(path, files);
+  return result;
+}
 
-  pthread_mutex_lock(&dir->lock);
-  head = g_list_first(files);
-  while(head != NULL) {
-    next = head->next;
-    // FIXME: list_bucket is using the same structure (file) as
-    // the cache which makes the code below confusing.
+/* stat a batch of listed entries, update their cache entries and queue
+   them for readdir, waiting while the queue is full */
+static void
+dir_handle_flush(struct dir_handle *dh)
+{
+  int result;
+  GList *head, *batch = g_list_reverse(dh->batch);
+
+  dh->batch = NULL;
+  dh->nbatch = 0;
+  if(batch == NULL)
+    return;
+
+  if((result = readdir_getattr(dh->path, batch)) != 0 && dh->err == 0)
+    dh->err = result;
+
+  for(head = batch; head != NULL; head = head->next) {
     struct file *file = head->data;
-    char *fullpath = get_path(path, file->name);
+    char *fullpath = get_path(dh->path, file->name);
     struct file *f = cache_get(fullpath);
     free(fullpath);
 
+    file->st->st_nlink = 1;
+
+    /* files changed locally are listed as they are here, the listing
+       still names the object they replace */
     pthread_mutex_lock(&f->lock);
-    if(f->st == NULL)
-      f->st = g_new0(struct stat, 1);
-    memcpy(f->st, file->st, sizeof(struct stat));
-    f->st->st_nlink = 1;
-    cache_touch(f);
+    if(f->st != NULL && (f->pending > 0 || f->upload != NULL ||
+        f->dirty != NULL || f->writers > 0)) {
+      memcpy(file->st, f->st, sizeof(struct stat));
+    } else {
+      if(f->st == NULL)
+        f->st = g_new0(struct stat, 1);
+      memcpy(f->st, file->st, sizeof(struct stat));
+      free(f->etag);
+      f->etag = file->etag;
+      file->etag = NULL;
+      f->lazy_meta = file->lazy_meta;
+      cache_touch(f);
+    }
     pthread_mutex_unlock(&f->lock);
 
-    filler(buf, (char *) f->name, f->st, 0);
-    dir->dir = g_list_append(dir->dir, f);
+    /* only listings short enough are kept for the directory */
+    if(dh->nlisted++ < READDIR_CACHE_MAX)
+      dh->listing = g_list_prepend(dh->listing, f);
+    else if(dh->listing != NULL) {
+      g_list_free(dh->listing);
+      dh->listing = NULL;
+    }
+  }
+
+  pthread_mutex_lock(&dh->lock);
+  while(g_queue_get_length(&dh->entries) >= READDIR_QUEUE_MAX && !dh->stop)
+    pthread_cond_wait(&dh->cond, &dh->lock);
+  for(head = batch; head != NULL; head = head->next)
+    g_queue_push_tail(&dh->entries, head->data);
+  pthread_cond_broadcast(&dh->cond);
+  pthread_mutex_unlock(&dh->lock);
+
+  g_list_free(batch);
+}
+
+static int
+dir_handle_listed(struct file *f, void *data)
+{
+  struct dir_handle *dh = data;
+
+  dh->batch = g_list_prepend(dh->batch, f);
+  if(++dh->nbatch >= READDIR_BATCH)
+    dir_handle_flush(dh);
+
+  return dh->stop ? 1 : 0;
+}
+
+static void *
+dir_lister(void *data)
+{
+  int result;
+  struct dir_handle *dh = data;
+
+  result = proxy_readdir(dh->path, dir_handle_listed, dh);
+
+  if(dh->stop) {
+    free_files(dh->batch);
+    dh->batch = NULL;
+  } else
+    dir_handle_flush(dh);
+
+  /* a complete listing replaces the directory's cached one */
+  if(result == 0 && !dh->stop && dh->nlisted <= READDIR_CACHE_MAX) {
+    struct file *dir = cache_get(dh->path);
+
+    pthread_mutex_lock(&dir->lock);
+    g_list_free(dir->dir);
+    dir->dir = g_list_reverse(dh->listing);
+    dh->listing = NULL;
+    pthread_mutex_unlock(&dir->lock);
+  }
+  g_list_free(dh->listing);
+  dh->listing = NULL;
+
+  pthread_mutex_lock(&dh->lock);
+  if(result != 0)
+    dh->err = result;
+  dh->done = true;
+  pthread_cond_broadcast(&dh->cond);
+  pthread_mutex_unlock(&dh->lock);
+
+  return NULL;
+}
+
+/* list the directory from the start, from copies of its cached listing
+   while that is valid */
+static int
+dir_handle_start(struct dir_handle *dh)
+{
+  GList *head;
+  struct file *dir = cache_get(dh->path);
+
+  dh->pos = 0;
+  dh->nlisted = 0;
+  dh->err = 0;
+  dh->done = false;
+  dh->stop = false;
+
+  pthread_mutex_lock(&dir->lock);
+  if(cache_valid(dir) && dir->dir != NULL) {
+    for(head = g_list_first(dir->dir); head != NULL; head = head->next) {
+      struct file *f = head->data;
+      struct file *entry = g_new0(struct file, 1);
 
-    head = next;
+      entry->name = strdup(f->name);
+      entry->st = g_new0(struct stat, 1);
+      if(f->st != NULL)
+        memcpy(entry->st, f->st, sizeof(struct stat));
+      g_queue_push_tail(&dh->entries, entry);
+    }
+    dh->done = true;
   }
   pthread_mutex_unlock(&dir->lock);
 
-  free_files(files);
+  if(dh->done)
+    return 0;
+
+  if(pthread_create(&dh->lister, NULL, dir_lister, dh) != 0) {
+    dh->err = -EIO;
+    dh->done = true;
+    return -EIO;
+  }
+  dh->started = true;
+
+  return 0;
+}
+
+static void
+dir_handle_stop(struct dir_handle *dh)
+{
+  struct file *f;
+
+  if(dh->started) {
+    pthread_mutex_lock(&dh->lock);
+    dh->stop = true;
+    pthread_cond_broadcast(&dh->cond);
+    pthread_mutex_unlock(&dh->lock);
+
+    pthread_join(dh->lister, NULL);
+    dh->started = false;
+  }
+
+  while((f = g_queue_pop_head(&dh->entries)) != NULL)
+    free_file(f);
+}
+
+static void
+dir_handle_free(struct dir_handle *dh)
+{
+  dir_handle_stop(dh);
+  pthread_cond_destroy(&dh->cond);
+  pthread_mutex_destroy(&dh->lock);
+  free(dh->path);
+  g_free(dh);
+}
+
+static int
+stormfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+  int result;
+  struct dir_handle *dh;
+
+  DEBUG("opendir: %s\n", path);
+
+  if((result = valid_path(path)) != 0)
+    return result;
+
+  dh = g_new0(struct dir_handle, 1);
+  dh->path = strdup(path);
+  g_queue_init(&dh->entries);
+  pthread_cond_init(&dh->cond, NULL);
+  pthread_mutex_init(&dh->lock, NULL);
+
+  if((result = dir_handle_start(dh)) != 0) {
+    dir_handle_free(dh);
+    return result;
+  }
+
+  fi->fh = (uintptr_t) dh;
+
+  return 0;
+}
+
+static int
+stormfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+  DEBUG("releasedir: %s\n", path);
+
+  dir_handle_free((struct dir_handle *) (uintptr_t) fi->fh);
+
+  return 0;
+}
+
+/* hands entries to filler as the lister queues them, offsets count
+   entries from the start of the directory */
+static int
+stormfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info *fi)
+{
+  int result = 0;
+  bool filled = false;
+  struct dir_handle *dh = (struct dir_handle *) (uintptr_t) fi->fh;
+
+  DEBUG("readdir: %s\n", path);
+
+  /* seeking back lists the directory again */
+  if(offset < dh->pos) {
+    dir_handle_stop(dh);
+    if((result = dir_handle_start(dh)) != 0)
+      return result;
+  }
+
+  for(;;) {
+    struct file *entry;
+
+    if(dh->pos < 2) {
+      const char *name = (dh->pos == 0) ? "." : "..";
+
+      if(dh->pos >= offset) {
+        if(filler(buf, name, NULL, dh->pos + 1) != 0)
+          break;
+        filled = true;
+      }
+      dh->pos++;
+      continue;
+    }
+
+    /* once something is filled, return rather than wait for more */
+    pthread_mutex_lock(&dh->lock);
+    while(g_queue_is_empty(&dh->entries) && !dh->done && !filled)
+      pthread_cond_wait(&dh->cond, &dh->lock);
+    entry = g_queue_pop_head(&dh->entries);
+    if(entry == NULL && dh->done && !filled)
+      result = dh->err;
+    pthread_cond_broadcast(&dh->cond);
+    pthread_mutex_unlock(&dh->lock);
+
+    if(entry == NULL)
+      break;
+
+    if(dh->pos >= offset) {
+      if(filler(buf, entry->name, entry->st, dh->pos + 1) != 0) {
+        pthread_mutex_lock(&dh->lock);
+        g_queue_push_head(&dh->entries, entry);
+        pthread_mutex_unlock(&dh->lock);
+        break;
+      }
+      filled = true;
+    }
+
+    free_file(entry);
+    dh->pos++;
+  }
 
   return result;
 }
@@ -985,7 +3964,6 @@ static int
 stormfs_readlink(const char *path, char *buf, size_t size)
 {
   int fd;
-  FILE *fp = NULL;
   int result;
   struct stat st;
   struct file *f;
@@ -1002,24 +3980,15 @@ stormfs_readlink(const char *path, char *buf, size_t size)
 
   f = cache_get(path);
   if(cache_file_valid(f)) {
-    char *cp = cache_path(f);
-
-    fp = fopen(cp, "a+");
-    free(cp);
-
-    if(fp == NULL)
-      return -errno;
-    if((fd = fileno(fp)) == -1)
+    if((fd = cache_open_file(f)) == -1)
       return -errno;
   } else {
     // file not available in cache, download it.
     if((fd = cache_create_file(f)) == -1)
       return -EIO;
-    if((fp = fdopen(fd, "a+")) == NULL)
-      return -errno;
 
-    if((result = proxy_open(path, fp)) != 0) {
-      fclose(fp);
+    if((result = proxy_open(path, fd)) != 0) {
+      close(fd);
       return result;
     }
   }
@@ -1047,27 +4016,24 @@ stormfs_readlink(const char *path, char *buf, size_t size)
 static int
 stormfs_release(const char *path, struct fuse_file_info *fi)
 {
-  int result = 0;
-  struct stat st;
+  int err, result = 0;
+  struct handle *h = get_handle(fi);
 
   DEBUG("release: %s\n", path);
 
-  /* if the file was opened read-only, we can assume it didn't
-     change and skip the upload process */
-  if((fi->flags & O_RDWR) || (fi->flags & O_WRONLY)) {
-    if(fsync(fi->fh) != 0)
-      return -errno;
-
-    if((result = stormfs_getattr(path, &st)) != 0)
-      return -result;
+  /* files opened read-only or left untouched didn't change, skip
+     the upload process */
+  if(((fi->flags & O_RDWR) || (fi->flags & O_WRONLY)) && handle_modified(h)) {
+    if(wb.on) {
+      writeback_queue(h);
+      return 0;
+    }
 
-    result = proxy_release(path, fi->fh, &st);
+    result = handle_upload_serial(h);
   }
 
-  if(close(fi->fh) != 0) {
-    perror("close");
-    return -errno;
-  }
+  if((err = handle_free(h)) != 0 && result == 0)
+    result = err;
 
   return result;
 }
@@ -1085,9 +4051,14 @@ stormfs_rename(const char *from, const char *to)
   if((result = valid_path(to)) != 0)
     return result;
 
-  if((result = stormfs_getattr(from, &st)) != 0)
+  if((result = stormfs_getattr_meta(from, &st)) != 0)
     return result;
 
+  if(S_ISDIR(st.st_mode))
+    writeback_drain();
+  writeback_wait(from);
+  writeback_wait(to);
+
   if((result = proxy_rename(from, to, &st)) != 0)
     return result;
 
@@ -1163,7 +4134,7 @@ stormfs_utimens(const char *path, const struct timespec ts[2])
   if((result = valid_path(path)) != 0)
     return result;
 
-  if((result = stormfs_getattr(path, &st)) != 0)
+  if((result = stormfs_getattr_meta(path, &st)) != 0)
     return result;
 
   st.st_mtime = ts[1].tv_sec;
@@ -1186,19 +4157,52 @@ static int
 stormfs_write(const char *path, const char *buf,
     size_t size, off_t offset, struct fuse_file_info *fi)
 {
-  struct file *f;
+  int result;
+  struct handle *h = get_handle(fi);
   DEBUG("write: %s\n", path);
 
-  f = cache_get(path);
-  if(cache_valid(f) && f->st != NULL) {
-    pthread_mutex_lock(&f->lock);
-    f->st->st_size += size;
-    cache_touch(f);
-    pthread_mutex_unlock(&f->lock);
-  }
+  /* partially written blocks must hold the remote data first */
+  if((result = cache_fetch(h->f, h->fd, offset, size)) != 0)
+    return result;
+
+  if((result = pwrite(h->fd, buf, size, offset)) == -1)
+    return -errno;
+
+  handle_written(h, offset, result);
+
+  return result;
+}
+
+#if FUSE_VERSION >= 29
+/* copy incoming data into the cache file with fuse_buf_copy, which
+   splices it from /dev/fuse when libfuse received it into a pipe. */
+static int
+stormfs_write_buf(const char *path, struct fuse_bufvec *buf,
+    off_t offset, struct fuse_file_info *fi)
+{
+  ssize_t result;
+  size_t size = fuse_buf_size(buf);
+  struct handle *h = get_handle(fi);
+  struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+  DEBUG("write_buf: %s\n", path);
+
+  /* partially written blocks must hold the remote data first */
+  if((result = cache_fetch(h->f, h->fd, offset, size)) != 0)
+    return result;
+
+  dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  dst.buf[0].fd = h->fd;
+  dst.buf[0].pos = offset;
+
+  if((result = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK)) < 0)
+    return result;
 
-  return pwrite(fi->fh, buf, size, offset);
+  handle_written(h, offset, result);
+
+  return result;
 }
+#endif
 
 char *
 stormfs_virtual_url(char *url, char *bucket)
@@ -1243,6 +4247,17 @@ set_defaults(void)
   stormfs.mime_path = "/etc/mime.types";
   stormfs.cache_path = "/tmp/stormfs";
   stormfs.cache_timeout = DEFAULT_CACHE_TIMEOUT;
+  stormfs.block_size = DEFAULT_BLOCK_SIZE;
+  stormfs.readahead_max = DEFAULT_READAHEAD_MAX;
+  stormfs.download_part_size = DEFAULT_DOWNLOAD_PART_SIZE;
+  stormfs.download_connections = DEFAULT_DOWNLOAD_CONNECTIONS;
+  stormfs.upload_connections = DEFAULT_UPLOAD_CONNECTIONS;
+  stormfs.upload_part_size = DEFAULT_UPLOAD_PART_SIZE;
+  stormfs.list_shards = DEFAULT_LIST_SHARDS;
+  stormfs.writeback_max = DEFAULT_WRITEBACK_MAX;
+  stormfs.default_uid = getuid();
+  stormfs.default_gid = getgid();
+  stormfs.default_mode = DEFAULT_FILE_MODE;
 }
 
 static void
@@ -1262,6 +4277,43 @@ validate_config(void)
     valid = false;
   }
 
+  if(stormfs.block_size == 0) {
+    fprintf(stderr, "%s: invalid block_size, see %s -h for usage\n",
+        stormfs.progname, stormfs.progname);
+    valid = false;
+  }
+
+  if(stormfs.download_part_size == 0 || stormfs.download_connections == 0) {
+    fprintf(stderr, "%s: invalid download_part_size or download_connections, "
+        "see %s -h for usage\n", stormfs.progname, stormfs.progname);
+    valid = false;
+  }
+
+  if(stormfs.upload_connections == 0) {
+    fprintf(stderr, "%s: invalid upload_connections, see %s -h for usage\n",
+        stormfs.progname, stormfs.progname);
+    valid = false;
+  }
+
+  if(stormfs.upload_part_size < MIN_UPLOAD_PART_SIZE) {
+    fprintf(stderr, "%s: upload_part_size must be at least %d, "
+        "see %s -h for usage\n", stormfs.progname, MIN_UPLOAD_PART_SIZE,
+        stormfs.progname);
+    valid = false;
+  }
+
+  if(stormfs.list_shards == 0) {
+    fprintf(stderr, "%s: invalid list_shards, see %s -h for usage\n",
+        stormfs.progname, stormfs.progname);
+    valid = false;
+  }
+
+  if(stormfs.default_mode & ~07777) {
+    fprintf(stderr, "%s: invalid default_mode, see %s -h for usage\n",
+        stormfs.progname, stormfs.progname);
+    valid = false;
+  }
+
   if(!valid_acl(stormfs.acl)) {
     fprintf(stderr, "%s: invalid ACL %s, see %s -h for usage\n",
         stormfs.progname, stormfs.acl, stormfs.progname);
@@ -1388,6 +4440,11 @@ show_debug_header(void)
   DEBUG("STORMFS virtual url:   %s\n", stormfs.virtual_url);
   DEBUG("STORMFS acl:           %s\n", stormfs.acl);
   DEBUG("STORMFS cache:         %s\n", (stormfs.cache) ? "on" : "off");
+  DEBUG("STORMFS lazy read:     %s\n", (stormfs.lazy_read) ? "on" : "off");
+  DEBUG("STORMFS cache size:    %uMB\n", stormfs.cache_size);
+  DEBUG("STORMFS write-back:    %s\n", (stormfs.writeback) ? "on" : "off");
+  DEBUG("STORMFS stream upload: %s\n", (stormfs.stream_upload) ? "on" : "off");
+  DEBUG("STORMFS fast readdir:  %s\n", (stormfs.fast_readdir) ? "on" : "off");
   DEBUG("STORMFS encryption:    %s\n", (stormfs.encryption) ? "on" : "off");
 }
 
@@ -1400,6 +4457,13 @@ stormfs_init(struct fuse_conn_info *conn)
   if(conn->capable & FUSE_CAP_BIG_WRITES)
     conn->want |= FUSE_CAP_BIG_WRITES;
 
+#if FUSE_VERSION >= 29
+  if(conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if(conn->capable & FUSE_CAP_SPLICE_READ)
+    conn->want |= FUSE_CAP_SPLICE_READ;
+#endif
+
   cache_mime_types();
   show_debug_header();
 
@@ -1413,12 +4477,48 @@ stormfs_init(struct fuse_conn_info *conn)
     exit(EXIT_FAILURE);
   }
 
+  if(meta_init() != 0) {
+    fprintf(stderr, "%s: unable to initialize metadata cache\n", stormfs.progname);
+    exit(EXIT_FAILURE);
+  }
+
+  if(lru_init() != 0) {
+    fprintf(stderr, "%s: unable to initialize cache eviction\n", stormfs.progname);
+    exit(EXIT_FAILURE);
+  }
+
+  if(readahead_init() != 0) {
+    fprintf(stderr, "%s: unable to initialize readahead\n", stormfs.progname);
+    exit(EXIT_FAILURE);
+  }
+
+  if(stream_init() != 0) {
+    fprintf(stderr, "%s: unable to initialize streaming uploads\n", stormfs.progname);
+    exit(EXIT_FAILURE);
+  }
+
+  if(writeback_init() != 0) {
+    fprintf(stderr, "%s: unable to initialize write-back\n", stormfs.progname);
+    exit(EXIT_FAILURE);
+  }
+
+  if(download_init() != 0) {
+    fprintf(stderr, "%s: unable to initialize downloads\n", stormfs.progname);
+    exit(EXIT_FAILURE);
+  }
+
   return NULL;
 }
 
 static void
 stormfs_destroy(void *data)
 {
+  writeback_destroy();
+  stream_destroy();
+  download_destroy();
+  readahead_destroy();
+  lru_destroy();
+  meta_destroy();
   cache_destroy();
   proxy_destroy();
   free(stormfs.bucket);
@@ -1459,8 +4559,50 @@ usage(const char *progname)
 "    -o mime_path=PATH       path to mime.types (default: /etc/mime.types)\n"
 "    -o cache_path=PATH      path for cached file storage (default: /tmp/stormfs)\n"
 "    -o cache_timeout=N      sets the cache timeout in seconds (default: 300)\n"
+"    -o cache_size=N         evict the least recently used files once\n"
+"                              cache_path holds N megabytes, 0 disables\n"
+"                              eviction (default: 0)\n"
 "    -o nocache              disable the cache (cache is enabled by default)\n"
-"\n", progname);
+"    -o lazy_read            fetch blocks of a file as they are read instead\n"
+"                              of downloading the whole file on open\n"
+"    -o block_size=N         size in bytes of the blocks files are fetched\n"
+"                              into the cache in (default: 4194304)\n"
+"    -o readahead_max=N      bytes of lazily read blocks fetched ahead of\n"
+"                              sequential readers, 0 disables readahead\n"
+"                              (default: 67108864)\n"
+"    -o download_part_size=N size in bytes of the ranges large files are\n"
+"                              downloaded in (default: 8388608)\n"
+"    -o download_connections=N\n"
+"                            number of ranges of a file downloaded in\n"
+"                              parallel (default: 8)\n"
+"    -o upload_connections=N number of parts of a large file uploaded in\n"
+"                              parallel (default: 8)\n"
+"    -o upload_part_size=N   smallest size in bytes of the parts large files\n"
+"                              are uploaded in, larger files use larger\n"
+"                              parts (default: 10485760)\n"
+"    -o list_shards=N        split listings of directories that span more\n"
+"                              than one page into N ranges of names listed\n"
+"                              in parallel (default: 1)\n", progname);
+  printf(
+"    -o writeback            upload files in the background once they are\n"
+"                              closed instead of during close\n"
+"    -o writeback_max=N      megabytes of closed files waiting to be\n"
+"                              uploaded before close blocks (default: 1024)\n"
+"    -o stream_upload        upload files written sequentially from empty in\n"
+"                              parts while they are written\n"
+"    -o fast_readdir         stat directory entries from the bucket listing\n"
+"                              instead of a HEAD request per entry, files\n"
+"                              and symlinks show as regular files with\n"
+"                              default_uid, default_gid and default_mode\n"
+"                              and their mtime is the object's LastModified\n"
+"                              until their metadata is fetched\n"
+"    -o default_uid=N        owner of files listed by fast_readdir\n"
+"                              (default: the mounting user)\n"
+"    -o default_gid=N        group of files listed by fast_readdir\n"
+"                              (default: the mounting user's group)\n"
+"    -o default_mode=N       octal permissions of files listed by\n"
+"                              fast_readdir (default: 0644)\n"
+"\n");
 }
 
 static struct fuse_operations stormfs_oper = {
@@ -1473,10 +4615,15 @@ static struct fuse_operations stormfs_oper = {
     .mkdir    = stormfs_mkdir,
     .mknod    = stormfs_mknod,
     .open     = stormfs_open,
+    .opendir  = stormfs_opendir,
     .read     = stormfs_read,
+#if FUSE_VERSION >= 29
+    .read_buf = stormfs_read_buf,
+#endif
     .readdir  = stormfs_readdir,
     .readlink = stormfs_readlink,
     .release  = stormfs_release,
+    .releasedir = stormfs_releasedir,
     .rename   = stormfs_rename,
     .rmdir    = stormfs_rmdir,
     .statfs   = stormfs_statfs,
@@ -1485,6 +4632,9 @@ static struct fuse_operations stormfs_oper = {
     .unlink   = stormfs_unlink,
     .utimens  = stormfs_utimens,
     .write    = stormfs_write,
+#if FUSE_VERSION >= 29
+    .write_buf = stormfs_write_buf,
+#endif
 };
 
 static int
@@ -15,6 +15,18 @@ enum service {
   AMAZON
 };
 
+struct handle;
+struct multipart;
+struct file;
+
+/* takes the listed entry, non-zero stops the listing */
+typedef int (*readdir_fn)(struct file *f, void *data);
+
+struct extent {
+  off_t offset;
+  off_t size;
+};
+
 struct stormfs {
   enum service service;
   bool ssl;
@@ -23,6 +35,10 @@ struct stormfs {
   int cache;
   int foreground;
   int verify_ssl;
+  int lazy_read;
+  int writeback;
+  int stream_upload;
+  int fast_readdir;
   char *acl;
   char *url;
   char *bucket;
@@ -38,6 +54,18 @@ struct stormfs {
   char *expires;
   char *cache_path;
   unsigned cache_timeout;
+  unsigned cache_size;
+  unsigned block_size;
+  unsigned readahead_max;
+  unsigned download_part_size;
+  unsigned download_connections;
+  unsigned upload_connections;
+  unsigned upload_part_size;
+  unsigned list_shards;
+  unsigned writeback_max;
+  unsigned default_uid;
+  unsigned default_gid;
+  unsigned default_mode;
   mode_t root_mode;
   GHashTable *mime_types;
 };
@@ -48,7 +76,27 @@ struct file {
   GList *dir;           /* list of files in this directory */
   GList *headers;       /* http headers */
   struct stat *st;      /* stat(2) buffer */
+  char *etag;           /* ETag of the remote object */
+  bool lazy_meta;       /* stat built from a listing, x-amz-meta-* not fetched */
   time_t valid;         /* entry timeout */
+  int refs;             /* references held on this entry */
+  int pending;          /* uploads queued or running */
+  struct handle *upload; /* newest handle queued for upload */
+  bool uploading;       /* an upload of the file is running */
+  int writers;          /* writable handles open on the file */
+  guchar *dirty;        /* blocks written since the last upload that went out */
+  size_t ndirty;        /* number of blocks the dirty map covers */
+  unsigned long writes; /* bumped on every write */
+  off_t size;           /* size of the remote object being fetched */
+  ino_t ino;            /* inode of the partially fetched cache file */
+  size_t nblocks;       /* number of blocks in the remote object */
+  size_t missing;       /* number of blocks not yet fetched */
+  guchar *blocks;       /* blocks present in the cache file */
+  guchar *fetching;     /* blocks currently being fetched */
+  char *blocks_etag;    /* ETag the cache file blocks were fetched from */
+  bool completed;       /* every block landed, the map isn't saved yet */
+  unsigned long gen;    /* bumped when the cache file is recreated or truncated */
+  pthread_cond_t cond;  /* signalled when blocks land */
   pthread_mutex_t lock; /* file-level lock */
 };
 
@@ -57,7 +105,9 @@ char *get_path(const char *path, const char *name);
 const char *get_mime_type(const char *filename);
 char *stormfs_virtual_url(char *url, char *bucket);
 void free_file(struct file *f);
+void free_files(GList *files);
 int stormfs_getattr(const char *path, struct stat *stbuf);
+int stormfs_getattr_meta(const char *path, struct stat *stbuf);
 int stormfs_unlink(const char *path);
 
 #endif // stormfs_H